@@ -25,18 +25,35 @@
     outbox
       do not acknoledge
 
-  Immediate box does not wait, nonimmediate waits forever.
-  It may have sense to have something in between: timed-out box which emits a
-  value after a timeout even if it is not fresh.
+  Immediate box does not wait, nonimmediate waits forever, or for .timeout
+  ms: then an outbox emits its value even if it is not fresh, and an inbox
+  acknowledges while still fresh.
 */
 
 #include "CasioSerial.h"
+#ifdef __AVR__
+#include <util/atomic.h>
+#endif
 
-HardwareSerial *casio_serial=NULL;
+Stream *casio_serial=NULL;
 CasioMailBox *casio_inboxes=NULL;
 CasioMailBox *casio_outboxes=NULL;
+#ifdef CASIO_LISTS
+CasioListBox *casio_list_inboxes=NULL;
+CasioListBox *casio_list_outboxes=NULL;
+#endif
+#ifdef CASIO_MATRICES
+CasioMatrixBox *casio_matrix_inboxes=NULL;
+CasioMatrixBox *casio_matrix_outboxes=NULL;
+#endif
+#ifdef CASIO_GROUPS
+CasioGroupBox *casio_group_outboxes=NULL;
+#endif
 
-#define CASIO_DEBUG
+// lists and matrices share the element streaming code
+#if defined(CASIO_LISTS) || defined(CASIO_MATRICES)
+#define CASIO_ARRAYS
+#endif
 
 void cccp_null_hook(char name)
 {
@@ -44,6 +61,115 @@ void cccp_null_hook(char name)
 
 void (*casio_receive_hook)(char)=&cccp_null_hook;
 
+#if CASIO_LOG_LEVEL>0
+void (*casio_log_sink)(byte level, const char *message)=NULL;
+
+// messages in CASIO_LOG_EVENT order
+#define CCCP_LOG_MESSAGE(e,text) const char CCCP_MESSAGE_##e[] PROGMEM = text;
+CCCP_LOG_MESSAGE(REJECT_HEADER, "rejected header")
+CCCP_LOG_MESSAGE(REJECT_DATA, "rejected data")
+CCCP_LOG_MESSAGE(NACK, "sent error")
+CCCP_LOG_MESSAGE(TIMEOUT, "timeout in state")
+CCCP_LOG_MESSAGE(NO_MAILBOX, "no mailbox for")
+CCCP_LOG_MESSAGE(RESEND, "asked again for")
+CCCP_LOG_MESSAGE(EXPIRED, "hold expired in state")
+CCCP_LOG_MESSAGE(HEADER, "header")
+CCCP_LOG_MESSAGE(DATA, "data")
+CCCP_LOG_MESSAGE(REPLY, "reply")
+const char *const cccp_log_messages[] PROGMEM = {
+  CCCP_MESSAGE_REJECT_HEADER, CCCP_MESSAGE_REJECT_DATA, CCCP_MESSAGE_NACK,
+  CCCP_MESSAGE_TIMEOUT, CCCP_MESSAGE_NO_MAILBOX, CCCP_MESSAGE_RESEND,
+  CCCP_MESSAGE_EXPIRED, CCCP_MESSAGE_HEADER, CCCP_MESSAGE_DATA,
+  CCCP_MESSAGE_REPLY
+};
+
+char *casio_log_format(const CasioLogEvent *e, char *message, int size)
+{
+  static const char hex[]="0123456789abcdef";
+  int n;
+  strncpy_P(message, (const char *)pgm_read_ptr(&cccp_log_messages[e->event]), size);
+  message[size-1]=0;
+  n=strlen(message);
+  switch( e->event ) {
+    case CASIO_LOG_NO_MAILBOX:
+      if( n+2<size ) {
+        message[n++]=' ';
+        message[n++]=(char)e->arg;
+      }
+      break;
+    case CASIO_LOG_TIMEOUT:
+    case CASIO_LOG_EXPIRED:
+      n+=snprintf(message+n, size-n, " %d", e->arg);
+      break;
+  }
+  for( int i=0; i<e->size && n+3<size; ++i ) {
+    message[n++]=' ';
+    message[n++]=hex[e->data[i]>>4];
+    message[n++]=hex[e->data[i]&0x0f];
+  }
+  message[n<size?n:size-1]=0;
+  return message;
+}
+
+#ifdef CASIO_LOG_BUFFER
+CasioLogEvent cccp_log_buffer[CASIO_LOG_BUFFER];
+byte cccp_log_head; // next slot to fill, moved by casio_poll()
+byte cccp_log_tail; // next slot to pass on, moved by casio_log_flush()
+unsigned int casio_log_dropped;
+#endif
+
+// Report an event with the leading bytes of a packet
+void cccp_log(byte level, byte event, byte arg, const byte *data, int size)
+{
+  if( NULL==casio_log_sink ) return;
+#ifdef CASIO_LOG_BUFFER
+  byte head=cccp_log_head;
+  byte next=head+1<CASIO_LOG_BUFFER?head+1:0;
+  if( next==__atomic_load_n(&cccp_log_tail, __ATOMIC_ACQUIRE) ) {
+    ++casio_log_dropped;
+    return;
+  }
+  CasioLogEvent *e=&cccp_log_buffer[head];
+#else
+  CasioLogEvent event_buf;
+  CasioLogEvent *e=&event_buf;
+#endif
+  e->level=level;
+  e->event=event;
+  e->arg=arg;
+  e->size=size<CASIO_LOG_BYTES?size:CASIO_LOG_BYTES;
+  if( NULL!=data ) memcpy(e->data, data, e->size);
+  else e->size=0;
+#ifdef CASIO_LOG_BUFFER
+  __atomic_store_n(&cccp_log_head, next, __ATOMIC_RELEASE);
+#else
+  char message[64];
+  casio_log_sink(level, casio_log_format(e, message, sizeof(message)));
+#endif
+}
+
+#ifdef CASIO_LOG_BUFFER
+void casio_log_flush()
+{
+  char message[64];
+  byte tail=cccp_log_tail;
+  while( tail!=__atomic_load_n(&cccp_log_head, __ATOMIC_ACQUIRE) ) {
+    CasioLogEvent *e=&cccp_log_buffer[tail];
+    if( NULL!=casio_log_sink )
+      casio_log_sink(e->level, casio_log_format(e, message, sizeof(message)));
+    tail=tail+1<CASIO_LOG_BUFFER?tail+1:0;
+    __atomic_store_n(&cccp_log_tail, tail, __ATOMIC_RELEASE);
+  }
+}
+#endif
+
+#define CCCP_LOG(level,event,arg,data,size) do{ \
+  if( CASIO_LOG_##level<=CASIO_LOG_LEVEL ) \
+    cccp_log(CASIO_LOG_##level, CASIO_LOG_##event, arg, data, size); }while(0)
+#else
+#define CCCP_LOG(level,event,arg,data,size) do{}while(0)
+#endif
+
 
 // find a mailbox for a name or create one
 
@@ -60,7 +186,88 @@ void fill_static_links(CasioMailBox *head, int count)
 #endif
 
 
+#ifdef CASIO_LISTS
+void fill_static_links(CasioListBox *head, int count)
+{
+  for(int i=1; i<count; ++i ) {
+    head[i-1].next=head+i;
+  }
+  head[count-1].next=NULL;
+}
+
+// find a list mailbox for List n, NULL if there is none
+CasioListBox *get_listbox(CasioListBox *head, byte number)
+{
+  for( ; NULL!=head; head=head->next )
+    if( head->number==number ) return head;
+  return NULL;
+}
+#endif
+
+#ifdef CASIO_MATRICES
+void fill_static_links(CasioMatrixBox *head, int count)
+{
+  for(int i=1; i<count; ++i ) {
+    head[i-1].next=head+i;
+  }
+  head[count-1].next=NULL;
+}
+
+// find a matrix mailbox for Mat X, NULL if there is none
+CasioMatrixBox *get_matrixbox(CasioMatrixBox *head, char name)
+{
+  for( ; NULL!=head; head=head->next )
+    if( head->name==name ) return head;
+  return NULL;
+}
+#endif
+
+#ifdef CASIO_GROUPS
+void fill_static_links(CasioGroupBox *head, int count)
+{
+  for(int i=1; i<count; ++i ) {
+    head[i-1].next=head+i;
+  }
+  head[count-1].next=NULL;
+}
+
+CasioGroupBox *get_groupbox(CasioGroupBox *head, char name, byte *slot)
+{
+  for( ; NULL!=head; head=head->next )
+    for( byte i=0; i<head->count; ++i )
+      if( head->names[i]==name ) {
+        *slot=i;
+        return head;
+      }
+  return NULL;
+}
+#endif
+
+#if defined(CASIO_STATIC_MAILBOX) && !defined(CASIO_COMPACT)
+#define CCCP_FAKEBOX
 CasioMailBox fakebox;
+#elif !defined(CASIO_STATIC_MAILBOX)
+/* Boxes past cccp_pool_unused have never been handed out; returned ones are
+ * kept on a free list through .next. Both take and return are O(1).
+ */
+CasioMailBox cccp_pool[CASIO_POOL_SIZE];
+CasioMailBox *cccp_pool_free;
+byte cccp_pool_unused;
+CasioPoolStats casio_pool;
+
+CasioMailBox *cccp_pool_take()
+{
+  CasioMailBox *p=cccp_pool_free;
+  if( NULL!=p ) cccp_pool_free=p->next;
+  else if( cccp_pool_unused<CASIO_POOL_SIZE ) p=&cccp_pool[cccp_pool_unused++];
+  else {
+    ++casio_pool.exhausted;
+    return NULL;
+  }
+  if( ++casio_pool.used>casio_pool.peak ) casio_pool.peak=casio_pool.used;
+  return p;
+}
+#endif
 
 CasioMailBox *get_mailbox(CasioMailBox **head, char name, bool create_if_not_exists)
 {
@@ -69,30 +276,106 @@ CasioMailBox *get_mailbox(CasioMailBox **head, char name, bool create_if_not_exi
     if( p->name == name ) return p;
     p=p->next;
   }
-#ifdef CASIO_DEBUG
-  Serial.print("Not found mailbox for ");
-  Serial.println(name);
-#endif
 #ifdef CASIO_STATIC_MAILBOX
+#ifndef CCCP_FAKEBOX
+  return NULL;
+#else
   fakebox.name=name;
   fakebox.next=NULL;
   fakebox.fresh=true;
   fakebox.immediate=true;
-  fakebox.value=12345.67;
+  fakebox.timeout=0;
+  fakebox.produce=NULL;
+#ifdef CASIO_QUEUES
+  fakebox.queue=NULL;
+#endif
+  fakebox.value=casio_to_value(12345.67);
   return &fakebox;
+#endif
 #else
   if( !create_if_not_exists ) return NULL;
-  p=(CasioMailBox*)malloc(sizeof(CasioMailBox));
-  if( NULL==p ) return NULL; // cannot allocate
+  p=cccp_pool_take();
+  if( NULL==p ) return NULL; // pool is empty
   // create new and update head
   p->name=name;
   p->next=*head;
+  p->link=head;
+  if( NULL!=p->next ) p->next->link=&p->next;
   *head=p;
   p->fresh=false;
   p->immediate=true; // signals are immediate by default to keep calc from waiting;
+  p->timeout=0;
+  p->value=0;
+#ifdef CASIO_COMPLEX
+  p->im=0;
+#endif
+  p->produce=NULL;
+#ifdef CASIO_QUEUES
+  p->queue=NULL;
+#endif
+  return p;
 #endif
 }
 
+#ifdef CASIO_LOOKUP_TABLE
+CasioMailBox *casio_inbox_table[CASIO_NAMES];
+CasioMailBox *casio_outbox_table[CASIO_NAMES];
+// list heads the tables were built from
+CasioMailBox *indexed_inboxes;
+CasioMailBox *indexed_outboxes;
+
+void index_mailbox_list(CasioMailBox **table, CasioMailBox *p)
+{
+  memset(table, 0, CASIO_NAMES*sizeof(CasioMailBox*));
+  for( ; NULL!=p; p=p->next ) {
+    int i=casio_name_index(p->name);
+    // first box for a name wins, like in get_mailbox()
+    if( i>=0 && NULL==table[i] ) table[i]=p;
+  }
+}
+
+void casio_index_mailboxes()
+{
+  index_mailbox_list(casio_inbox_table, casio_inboxes);
+  index_mailbox_list(casio_outbox_table, casio_outboxes);
+  indexed_inboxes=casio_inboxes;
+  indexed_outboxes=casio_outboxes;
+}
+
+// look up a name in a table, fall back to get_mailbox() on a miss
+CasioMailBox *lookup_mailbox(CasioMailBox **table, CasioMailBox **head,
+  CasioMailBox **indexed, char name, bool create_if_not_exists)
+{
+  int i=casio_name_index(name);
+  if( i>=0 && NULL!=table[i] ) return table[i];
+  CasioMailBox *p=get_mailbox(head, name, create_if_not_exists);
+#ifndef CASIO_STATIC_MAILBOX
+  // a box just made is the new head: index it rather than rebuild the tables
+  if( NULL!=p && p==*head && p->next==*indexed ) {
+    if( i>=0 ) table[i]=p;
+    *indexed=p;
+  }
+#endif
+  return p;
+}
+
+CasioMailBox *get_inbox(char name, bool create_if_not_exists)
+{
+  if( casio_inboxes!=indexed_inboxes || casio_outboxes!=indexed_outboxes )
+    casio_index_mailboxes();
+  return lookup_mailbox(casio_inbox_table, &casio_inboxes, &indexed_inboxes,
+    name, create_if_not_exists);
+}
+
+CasioMailBox *get_outbox(char name, bool create_if_not_exists)
+{
+  if( casio_inboxes!=indexed_inboxes || casio_outboxes!=indexed_outboxes )
+    casio_index_mailboxes();
+  return lookup_mailbox(casio_outbox_table, &casio_outboxes, &indexed_outboxes,
+    name, create_if_not_exists);
+}
+#endif
+
 /*
  * --Receive()     --Send()
  * Casio MCU       Casio MCU
@@ -128,6 +411,7 @@ enum CCCP_STATE {
   CCCP_SEND_ACK1,
   CCCP_SEND_WAITDATA0,
   CCCP_SEND_WAITDATA,
+  CCCP_SEND_NEXTDATA,
   CCCP_SEND_EXECUTEDATA,
   CCCP_RECEIVE_WAITDATA,
   CCCP_RECEIVE_ACK1,
@@ -140,14 +424,310 @@ enum CCCP_STATE {
   CCCP_RECEIVE_CLIENTWAIT3,
   CCCP_RECEIVE_END0,
   CCCP_RECEIVE_END,
+  CCCP_RESEND,
   CCCP_IDLE
 };
 
+/* Session being served by cccp_poll_session() */
+CasioSession *cccp;
+
+// the session of casio_serial
+CasioSession cccp_default;
+CasioSession *casio_sessions=NULL;
+
+// mailbox list of the current session, shared one if it has none
+#define CCCP_BOXES(head) (NULL!=cccp->head?cccp->head:casio_##head)
+
+#ifdef CASIO_STATIC_MAILBOX
+#define CCCP_CREATE false
+#else
+// boxes are made for new names on their first :VAL or :REQ
+#define CCCP_CREATE true
+
+// a transaction of the session loses its box: a queued value has nowhere to
+// go, a complex value being sent is finished with zeros
+void cccp_detach(CasioSession *s, CasioMailBox *p)
+{
+  if( s->actionbox!=p ) return;
+  s->actionbox=NULL;
+#ifdef CASIO_QUEUES
+  s->queued=false;
+#endif
+}
+
+bool casio_free_mailbox(CasioMailBox **head, char name)
+{
+  CasioMailBox *p=NULL;
+#ifdef CASIO_LOOKUP_TABLE
+  // the shared lists find the box in their table, which is then kept in sync
+  CasioMailBox **table=NULL, **indexed=NULL;
+  if( head==&casio_inboxes ) {
+    table=casio_inbox_table;
+    indexed=&indexed_inboxes;
+  } else if( head==&casio_outboxes ) {
+    table=casio_outbox_table;
+    indexed=&indexed_outboxes;
+  }
+  if( NULL!=table ) {
+    if( casio_inboxes!=indexed_inboxes || casio_outboxes!=indexed_outboxes )
+      casio_index_mailboxes();
+    int i=casio_name_index(name);
+    if( i>=0 ) {
+      p=table[i];
+      if( NULL==p ) return false;
+      table[i]=NULL; // a later box of the same name is found by get_mailbox()
+    }
+  }
+#endif
+  if( NULL==p ) p=get_mailbox(head, name);
+  if( NULL==p ) return false;
+  CasioMailBox **link=p->link;
+  if( NULL==link || *link!=p ) {
+    // the list was linked by the sketch
+    link=head;
+    while( NULL!=*link && *link!=p ) link=&(*link)->next;
+    if( NULL==*link ) return false;
+  }
+  *link=p->next;
+  if( NULL!=p->next ) p->next->link=link;
+#ifdef CASIO_LOOKUP_TABLE
+  if( NULL!=indexed && *indexed==p ) *indexed=*head;
+#endif
+  cccp_detach(&cccp_default, p);
+  for( CasioSession *s=casio_sessions; NULL!=s; s=s->next ) cccp_detach(s, p);
+  // boxes that did not come from the pool are only unlinked
+  if( p>=cccp_pool && p<cccp_pool+CASIO_POOL_SIZE ) {
+    p->next=cccp_pool_free;
+    cccp_pool_free=p;
+    --casio_pool.used;
+  }
+  return true;
+}
+#endif
+
+#ifdef CASIO_STATS
+static_assert(CCCP_IDLE+1==CASIO_STATES, "CASIO_STATES is out of date");
+
+CasioStats casio_stats;
+#define CCCP_STAT(counter) (++casio_stats.counter)
+#define CCCP_STAT_ADD(counter,n) (casio_stats.counter+=(n))
+
+// names in CCCP_STATE order
+#define CCCP_STATE_NAME(s) const char CCCP_NAME_##s[] PROGMEM = #s;
+CCCP_STATE_NAME(ALERT)
+CCCP_STATE_NAME(NACK)
+CCCP_STATE_NAME(GETHEADER0)
+CCCP_STATE_NAME(GETHEADER)
+CCCP_STATE_NAME(SEND_ACK1)
+CCCP_STATE_NAME(SEND_WAITDATA0)
+CCCP_STATE_NAME(SEND_WAITDATA)
+CCCP_STATE_NAME(SEND_NEXTDATA)
+CCCP_STATE_NAME(SEND_EXECUTEDATA)
+CCCP_STATE_NAME(RECEIVE_WAITDATA)
+CCCP_STATE_NAME(RECEIVE_ACK1)
+CCCP_STATE_NAME(RECEIVE_CLIENTWAIT1)
+CCCP_STATE_NAME(RECEIVE_VAL0)
+CCCP_STATE_NAME(RECEIVE_VAL)
+CCCP_STATE_NAME(RECEIVE_CLIENTWAIT2)
+CCCP_STATE_NAME(RECEIVE_0101_0)
+CCCP_STATE_NAME(RECEIVE_0101)
+CCCP_STATE_NAME(RECEIVE_CLIENTWAIT3)
+CCCP_STATE_NAME(RECEIVE_END0)
+CCCP_STATE_NAME(RECEIVE_END)
+CCCP_STATE_NAME(RESEND)
+CCCP_STATE_NAME(IDLE)
+const char *const cccp_state_names[CASIO_STATES] PROGMEM = {
+  CCCP_NAME_ALERT, CCCP_NAME_NACK, CCCP_NAME_GETHEADER0, CCCP_NAME_GETHEADER,
+  CCCP_NAME_SEND_ACK1, CCCP_NAME_SEND_WAITDATA0, CCCP_NAME_SEND_WAITDATA,
+  CCCP_NAME_SEND_NEXTDATA, CCCP_NAME_SEND_EXECUTEDATA,
+  CCCP_NAME_RECEIVE_WAITDATA, CCCP_NAME_RECEIVE_ACK1,
+  CCCP_NAME_RECEIVE_CLIENTWAIT1, CCCP_NAME_RECEIVE_VAL0, CCCP_NAME_RECEIVE_VAL,
+  CCCP_NAME_RECEIVE_CLIENTWAIT2, CCCP_NAME_RECEIVE_0101_0,
+  CCCP_NAME_RECEIVE_0101, CCCP_NAME_RECEIVE_CLIENTWAIT3,
+  CCCP_NAME_RECEIVE_END0, CCCP_NAME_RECEIVE_END, CCCP_NAME_RESEND,
+  CCCP_NAME_IDLE
+};
+
+const char *casio_state_name(int state)
+{
+  if( state<0 || state>=CASIO_STATES ) return NULL;
+  return (const char *)pgm_read_ptr(&cccp_state_names[state]);
+}
+
+void cccp_stat_dwell(CasioDwell *d, unsigned long us)
+{
+  int b=0;
+  for( unsigned long t=us>>3; 0!=t && b<CASIO_STAT_BUCKETS-1; t>>=3 ) ++b;
+  ++d->visits;
+  d->time+=us;
+  if( d->hist[b]<(unsigned int)-1 ) ++d->hist[b];
+}
+
+// account for a state change since the last call
+void cccp_stat_track()
+{
+  if( cccp->state==cccp->stat_state ) return;
+  unsigned long now=micros();
+  cccp_stat_dwell(&casio_stats.state[cccp->stat_state], now-cccp->stat_since);
+  if( CCCP_IDLE==cccp->stat_state ) cccp->stat_start=now;
+  if( CCCP_IDLE==cccp->state )
+    cccp_stat_dwell(&casio_stats.transaction, now-cccp->stat_start);
+  cccp->stat_state=cccp->state;
+  cccp->stat_since=now;
+}
+
+void casio_stats_reset()
+{
+  unsigned long now=micros();
+  memset(&casio_stats, 0, sizeof(casio_stats));
+  cccp_default.stat_since=now;
+  for( CasioSession *s=casio_sessions; NULL!=s; s=s->next ) s->stat_since=now;
+}
+#else
+#define CCCP_STAT(counter)
+#define CCCP_STAT_ADD(counter,n)
+#endif
+
+
+/* Fresh names are set by casio_poll() and taken by the firmware, possibly
+ * while casio_poll() runs from an interrupt. AVR has no 32-bit atomic
+ * instructions, so interrupts are held off there instead.
+ */
+void cccp_mark_fresh()
+{
+#ifdef CCCP_FAKEBOX
+  if( &fakebox==cccp->actionbox ) return; // not a box of the firmware
+#endif
+  int i=casio_name_index(cccp->varname);
+  if( i<0 ) return;
+#ifdef __AVR__
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { cccp->fresh_names|=(uint32_t)1<<i; }
+#else
+  __atomic_fetch_or(&cccp->fresh_names, (uint32_t)1<<i, __ATOMIC_RELEASE);
+#endif
+}
+
+uint32_t cccp_take_fresh(CasioSession *session)
+{
+#ifdef __AVR__
+  uint32_t bits;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    bits=session->fresh_names;
+    session->fresh_names=0;
+  }
+  return bits;
+#else
+  return __atomic_exchange_n(&session->fresh_names, 0, __ATOMIC_ACQ_REL);
+#endif
+}
+
+#ifdef CASIO_GROUPS
+/* Group state: bank being filled in bits 0-1, current bank in bits 2-3,
+ * latched bank in bits 4-5, 3 if none. The firmware moves the first two on
+ * publishing, casio_poll() the latched one, possibly from an interrupt, so
+ * every change is made atomically on the whole byte.
+ */
+#define CCCP_GROUP_NONE 3
+
+// state after the filled bank is published
+byte cccp_group_published(byte state)
+{
+  byte fill=state&3;
+  byte current=(state>>2)&3;
+  byte latched=state>>4;
+  // refill the old current bank, or the third one if it is latched
+  byte next=latched==current?3-fill-current:current;
+  return next|fill<<2|latched<<4;
+}
+
+void casio_group_publish(CasioGroupBox *group)
+{
+#ifdef __AVR__
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    group->state=cccp_group_published(group->state);
+  }
+#else
+  byte state=__atomic_load_n(&group->state, __ATOMIC_RELAXED);
+  while( !__atomic_compare_exchange_n(&group->state, &state,
+    cccp_group_published(state), true, __ATOMIC_RELEASE, __ATOMIC_RELAXED) ) ;
+#endif
+}
+
+// set the latched bank: the current one, or none; returns the new state
+byte cccp_group_latch(CasioGroupBox *group, bool latch)
+{
+  byte next;
+#ifdef __AVR__
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    byte state=group->state;
+    next=(state&0x0f)|(latch?(state&0x0c)<<2:CCCP_GROUP_NONE<<4);
+    group->state=next;
+  }
+#else
+  byte state=__atomic_load_n(&group->state, __ATOMIC_RELAXED);
+  do {
+    next=(state&0x0f)|(latch?(state&0x0c)<<2:CCCP_GROUP_NONE<<4);
+  } while( !__atomic_compare_exchange_n(&group->state, &state, next, true,
+    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) );
+#endif
+  return next;
+}
 
-int cccp_state=CCCP_IDLE;
+/* A :REQ for a member: keep the latched sample or latch the current one.
+ * The session keeps the bank it is served from, taken from one read of the
+ * state, so another session releasing the latch meanwhile cannot make it
+ * read past the banks.
+ */
+void cccp_group_request()
+{
+  CasioGroupBox *g=cccp->groupbox;
+  byte state=__atomic_load_n(&g->state, __ATOMIC_ACQUIRE);
+  if( CCCP_GROUP_NONE==state>>4 || 0!=(g->served&(1<<cccp->group_slot))
+  || (0!=g->timeout && (CasioMillis)((CasioMillis)millis()-g->latched_at)>=g->timeout) ) {
+    state=cccp_group_latch(g, true);
+    g->served=0;
+    g->latched_at=millis();
+  }
+  cccp->group_bank=state>>4;
+}
 
-/* Mailbox for currently progressing request */
-CasioMailBox *cccp_actionbox;
+// the member has been received; release the sample once all have been
+void cccp_group_served()
+{
+  CasioGroupBox *g=cccp->groupbox;
+  g->served|=1<<cccp->group_slot;
+  g->latched_at=millis();
+  if( g->served==(byte)((1<<g->count)-1) ) cccp_group_latch(g, false);
+}
+#endif
+
+#ifdef CASIO_QUEUES
+/* Each index is written by one side only: .head here, .tail by the firmware.
+ * A slot is filled before .head moves past it and read before .tail does.
+ * Values are put by cccp_queue_put() below.
+ */
+bool casio_queue_get(CasioQueue *q, double *value, double *im)
+{
+  byte tail=q->tail;
+  if( tail==__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) ) return false; // empty
+  *value=q->data[tail];
+  if( NULL!=im ) {
+#ifdef CASIO_COMPLEX
+    *im=NULL!=q->im?q->im[tail]:0.0;
+#else
+    *im=0.0;
+#endif
+  }
+  __atomic_store_n(&q->tail, (byte)(tail+1<q->size?tail+1:0), __ATOMIC_RELEASE);
+  return true;
+}
+
+int casio_queue_count(CasioQueue *q)
+{
+  int n=__atomic_load_n(&q->head, __ATOMIC_ACQUIRE)-__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+  return n<0?n+q->size:n;
+}
+#endif
 
 /* Protocol communication symbols */
 #define CASIO_ATT 0x15
@@ -163,6 +743,9 @@ CasioMailBox *cccp_actionbox;
 #define CASIO_B_VARTAG 19 // 'Variable' tag
 #define CASIO_B_USED1 8
 #define CASIO_B_USED2 10
+// "used" bytes are low bytes of the dimensions
+#define CASIO_B_ROWS 7 // 2 bytes, big endian
+#define CASIO_B_COLS 9 // 2 bytes, big endian
 #define CASIO_B_CHECKSUM 49
 #define CASIO_B_SIZE 50
 
@@ -176,10 +759,35 @@ CasioMailBox *cccp_actionbox;
 // TODO: something better than this
 #define CASIO_DEFAULT_VALUE 987.654
 
-byte cccp_buffer[CASIO_B_SIZE];
-int cccp_buffer_index;
-int cccp_buffer_size;
-char cccp_varname; // recently requested name; needed if there is no mailbox for it
+static_assert(CASIO_B_SIZE<=CASIO_BUFFER_SIZE, "CASIO_BUFFER_SIZE is too small");
+
+#ifdef CASIO_QUEUES
+// value of the :0101 packet still in the session's buffer to its queue
+bool cccp_queue_put(CasioQueue *q)
+{
+  byte head=q->head;
+  byte next=head+1<q->size?head+1:0;
+  if( next==__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) ) return false; // full
+  q->data[head]=casio_number_parse(&cccp->buffer[CASIO_B_RE]);
+#ifdef CASIO_COMPLEX
+  if( NULL!=q->im ) q->im[head]=cccp->buffer_size==CASIO_C_SIZE
+    ? casio_number_parse(&cccp->buffer[CASIO_B_IM]) : 0.0;
+#endif
+  __atomic_store_n(&q->head, next, __ATOMIC_RELEASE);
+  return true;
+}
+#endif
+
+#ifdef CASIO_GROUPS
+// the member's value in the bank latched for this session
+double cccp_group_value()
+{
+  CasioGroupBox *g=cccp->groupbox;
+  if( cccp->group_bank>=CCCP_GROUP_NONE || cccp->group_slot>=g->count )
+    return CASIO_DEFAULT_VALUE;
+  return casio_from_value(g->banks[cccp->group_bank*g->count+cccp->group_slot]);
+}
+#endif
 
 byte casio_checksum(byte *buffer, int size)
 {
@@ -191,7 +799,16 @@ byte casio_checksum(byte *buffer, int size)
   return 1+~(chk-0x3a);
 }
 
-const byte PACKET_END[] PROGMEM={
+// Same as casio_checksum(), usable in constant expressions to verify
+// precomputed checksums of constant packets.
+constexpr byte casio_checksum_const(const byte *buffer, int size, byte chk=0)
+{
+  return size==0 ? (byte)(0x3a-chk)
+    : casio_checksum_const(buffer+1, size-1, (byte)(chk+buffer[0]));
+}
+
+// Constant packets are transmitted directly from program memory
+constexpr byte PACKET_END[] PROGMEM={
  ':','E','N','D', 0xff,
  0xff, 0xff, 0xff, 0xff, 0xff,  0xff, 0xff, 0xff, 0xff, 0xff,
  0xff, 0xff, 0xff, 0xff, 0xff,  0xff, 0xff, 0xff, 0xff, 0xff,
@@ -200,6 +817,25 @@ const byte PACKET_END[] PROGMEM={
  0xff, 0xff, 0xff, 0xff,
  'V'
 };
+static_assert(PACKET_END[CASIO_B_CHECKSUM]==casio_checksum_const(PACKET_END, CASIO_B_CHECKSUM), ":END checksum");
+
+/* :VAL header for a real named variable, the name is 0.
+ * The name byte only needs to be patched. Checksum is a negated sum of bytes,
+ * so it is adjusted by subtracting the name.
+ */
+constexpr byte PACKET_VAL[] PROGMEM={
+ ':','V','A','L', 0,
+ 'V','M', 0,1, 0,1, // rank, used
+ 0, // name
+ 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+ 'V','a','r','i','a','b','l','e',
+ 'R', 0x0a, // real/complex
+ 0xff, 0xff, 0xff, 0xff, 0xff,  0xff, 0xff, 0xff, 0xff, 0xff,
+ 0xff, 0xff, 0xff, 0xff, 0xff,  0xff, 0xff, 0xff, 0xff, 0xff,
+ 0x11
+};
+static_assert(PACKET_VAL[CASIO_B_CHECKSUM]==casio_checksum_const(PACKET_VAL, CASIO_B_CHECKSUM), ":VAL checksum");
+static_assert(sizeof(PACKET_VAL)==CASIO_B_SIZE, ":VAL size");
 
 const byte* HEADER_END=&PACKET_END[0];
 const byte HEADER_REQ[] PROGMEM={ ':','R','E','Q', 0 };
@@ -223,90 +859,354 @@ byte bcd(int v){
 
 #define CASIO_IM     0x80
 
-#ifdef CASIO_DEBUG
-void serial_dump(byte *buffer, size_t size){
-  char buf[10];
-  for(int i=0; i<size; ++i){
-    sprintf(buf," %02x",buffer[i]);
-    Serial.print(buf);
+
+/*
+ * Numbers are converted without text formatting and without pow(): the value
+ * is scaled to an integer mantissa of CASIO_DIGITS decimal digits by a power
+ * of ten, rounded once, and the mantissa is packed into BCD two digits at a
+ * time.
+ */
+
+/* Significant digits carried by a double.
+ * Arduino's doubles are 4 bytes (floats), converted with 9 digits, which
+ * bring every float back unchanged. Platforms with 8-byte doubles (ARM,
+ * ESP32, host) carry all 15 digits of the calculator. CASIO_FLOAT_CODEC
+ * selects the 9-digit codec there too, to test it on a host.
+ */
+#if __SIZEOF_DOUBLE__ >= 8 && !defined(CASIO_FLOAT_CODEC)
+#define CASIO_DIGITS 15
+typedef uint64_t casio_mantissa;
+#define CASIO_MANTISSA_MIN 100000000000000ULL // 10^(CASIO_DIGITS-1)
+#define CASIO_MANTISSA_LIM 1000000000000000ULL // 10^CASIO_DIGITS
+
+/* Scaling is done in double-double arithmetic: a value is the unevaluated
+ * sum hi+lo of two doubles, about 106 bits, and products of two doubles are
+ * exact with fma(). 10^e is an exact power of ten up to 10^22, times 10^22
+ * for 10^23..10^31, times 10^(32q) from a table rounded to 106 bits. The
+ * result is rounded to a double or to the mantissa once, at the end, so
+ * numbers come out correctly rounded over the calculator's whole range.
+ */
+typedef struct { double hi, lo; } casio_dd;
+typedef casio_dd casio_scaled;
+
+// Powers of ten which are exact in a double
+const double POW10_EXACT[] PROGMEM={
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+#define CASIO_POW10_EXACT 22
+
+// 10^(32q) for q=-4..3, the nearest double and the rest
+const casio_dd POW10_32Q[] PROGMEM={
+  { 1e-128, -5.401408859568103e-145 },
+  { 1e-96, 9.37078945091382e-113 },
+  { 1e-64, 3.469426116645307e-81 },
+  { 1e-32, -5.59673099762419e-49 },
+  { 1.0, 0.0 },
+  { 1e+32, -5366162204393472.0 },
+  { 1e+64, -2.1320419009454396e+47 },
+  { 1e+96, -4.9861653971908895e+79 }
+};
+
+casio_dd casio_dd_mul(casio_dd a, casio_dd b)
+{
+  casio_dd r;
+  double p=a.hi*b.hi;
+  double e=fma(a.hi,b.hi,-p)+(a.hi*b.lo+a.lo*b.hi);
+  r.hi=p+e;
+  r.lo=e-(r.hi-p);
+  return r;
+}
+
+// v*10^e, e in -128..127
+casio_dd casio_scale10(double v, int e)
+{
+  int q=e>>5; // rounded down
+  int r=e&31;
+  casio_dd x={ v, 0.0 };
+  if( r>CASIO_POW10_EXACT ) {
+    casio_dd p={ POW10_EXACT[CASIO_POW10_EXACT], 0.0 };
+    x=casio_dd_mul(x,p);
+    r-=CASIO_POW10_EXACT;
+  }
+  casio_dd p={ POW10_EXACT[r], 0.0 };
+  x=casio_dd_mul(x,p);
+  if( 0!=q ) x=casio_dd_mul(x,POW10_32Q[q+4]);
+  return x;
+}
+
+inline bool casio_scaled_ge(casio_dd s, casio_mantissa m)
+{
+  return s.hi>=m;
+}
+
+// nearest integer, halves rounded up
+casio_mantissa casio_scaled_round(casio_dd s)
+{
+  double i=floor(s.hi);
+  double f=(s.hi-i)+s.lo;
+  casio_mantissa m=(casio_mantissa)i;
+  if( f>=0.5 ) ++m;
+  else if( f<-0.5 ) --m;
+  return m;
+}
+
+// nearest double to m*10^e
+double casio_decimal(casio_mantissa m, int e)
+{
+  return casio_scale10((double)m,e).hi;
+}
+#else
+#define CASIO_DIGITS 9
+typedef uint32_t casio_mantissa;
+#define CASIO_MANTISSA_MIN 100000000UL // 10^(CASIO_DIGITS-1)
+#define CASIO_MANTISSA_LIM 1000000000UL // 10^CASIO_DIGITS
+
+/* A float is an integer of 24 bits times a power of two, so scaling it by
+ * 10^e = 5^e*2^e is exact in integers: the mantissa times 5^e, or divided by
+ * 5^-e, and shifted. The integers are kept in 16-bit words, which AVR
+ * multiplies and divides in short steps, and the result is rounded once.
+ * 9 digits then bring every float back unchanged.
+ */
+#define CASIO_BIG_WORDS 12 // 192 bits, enough for any float and the range
+typedef struct {
+  uint16_t w[CASIO_BIG_WORDS]; // least significant first
+  byte n; // words in use
+} casio_big;
+
+const uint16_t POW5[] PROGMEM={ 1, 5, 25, 125, 625, 3125, 15625 };
+#define CASIO_POW5_TOP 6
+
+void casio_big_set(casio_big *a, uint32_t v)
+{
+  a->w[0]=v;
+  a->w[1]=v>>16;
+  a->n=0!=a->w[1]?2:0!=a->w[0]?1:0;
+}
+
+void casio_big_mul(casio_big *a, uint16_t f)
+{
+  uint32_t carry=0;
+  for( byte i=0; i<a->n; ++i ) {
+    carry+=(uint32_t)a->w[i]*f;
+    a->w[i]=carry;
+    carry>>=16;
+  }
+  if( 0!=carry && a->n<CASIO_BIG_WORDS ) a->w[a->n++]=carry;
+}
+
+// a/=d rounded down, returns the remainder
+uint16_t casio_big_div(casio_big *a, uint16_t d)
+{
+  uint32_t r=0;
+  for( byte i=a->n; i-->0; ) {
+    r=r<<16|a->w[i];
+    a->w[i]=r/d;
+    r%=d;
+  }
+  while( a->n>0 && 0==a->w[a->n-1] ) --a->n;
+  return r;
+}
+
+// a*=2^k, or a/=2^-k rounded down
+void casio_big_shift(casio_big *a, int k)
+{
+  for( ; k>=16 && a->n<CASIO_BIG_WORDS; k-=16 ) {
+    memmove(&a->w[1],&a->w[0],a->n*sizeof(a->w[0]));
+    a->w[0]=0;
+    ++a->n;
+  }
+  for( ; k<=-16; k+=16 ) {
+    if( 0==a->n ) return;
+    memmove(&a->w[0],&a->w[1],--a->n*sizeof(a->w[0]));
+  }
+  if( k>0 ) casio_big_mul(a,1<<k);
+  else if( k<0 ) casio_big_div(a,1<<-k);
+}
+
+void casio_big_mul5(casio_big *a, int e)
+{
+  for( ; e>=CASIO_POW5_TOP; e-=CASIO_POW5_TOP )
+    casio_big_mul(a,pgm_read_word(&POW5[CASIO_POW5_TOP]));
+  casio_big_mul(a,pgm_read_word(&POW5[e]));
+}
+
+// a/=5^e rounded down, true if anything was left over
+bool casio_big_div5(casio_big *a, int e)
+{
+  bool rest=false;
+  for( ; e>=CASIO_POW5_TOP; e-=CASIO_POW5_TOP )
+    rest|=0!=casio_big_div(a,pgm_read_word(&POW5[CASIO_POW5_TOP]));
+  rest|=0!=casio_big_div(a,pgm_read_word(&POW5[e]));
+  return rest;
+}
+
+bool casio_big_bit(const casio_big *a, int i)
+{
+  return i>>4<a->n && 0!=(a->w[i>>4]>>(i&15)&1);
+}
+
+int casio_big_length(const casio_big *a)
+{
+  if( 0==a->n ) return 0;
+  int len=a->n*16;
+  while( !casio_big_bit(a,len-1) ) --len;
+  return len;
+}
+
+// count bits of a from bit i on, count<=24
+uint32_t casio_big_bits(const casio_big *a, int i, int count)
+{
+  uint32_t r=0;
+  while( count-->0 ) r=r<<1|casio_big_bit(a,i+count);
+  return r;
+}
+
+// any of the bits of a below bit i
+bool casio_big_any(const casio_big *a, int i)
+{
+  for( int k=0; k<i>>4; ++k ) if( 0!=a->w[k] ) return true;
+  return 0!=(i&15) && i>>4<a->n && 0!=(a->w[i>>4]&((1<<(i&15))-1));
+}
+
+// nearest float to (a+f)*2^b, 0<f<1 if rest else f=0; halves to even
+double casio_big_float(const casio_big *a, int b, bool rest)
+{
+  int len=casio_big_length(a);
+  if( 0==len ) return 0.0;
+  int lead=len-1+b; // exponent of the leading bit
+  int keep=lead<-126?lead+150:24; // subnormals have fewer bits
+  if( keep<0 ) return 0.0;
+  int drop=len-keep;
+  if( drop<=0 ) return ldexp((double)casio_big_bits(a,0,len),b);
+  uint32_t m=casio_big_bits(a,drop,keep);
+  if( casio_big_bit(a,drop-1) && (rest || casio_big_any(a,drop-1) || 0!=(m&1)) )
+    ++m;
+  // rounding up may reach the next power of two
+  if( lead+(int)(m>>keep)>127 ) return INFINITY;
+  return ldexp((double)m,b+drop);
+}
+
+typedef uint64_t casio_scaled; // twice the scaled value, rounded down
+
+// floor(2*v*10^e) for a positive float v, no more than 64 bits
+casio_scaled casio_scale10(double v, int e)
+{
+  int b;
+  float f=frexp((float)v,&b);
+  casio_big a;
+  casio_big_set(&a,(uint32_t)ldexp(f,24));
+  b-=23; // v*2 = mantissa*2^b
+  if( e>=0 ) {
+    casio_big_mul5(&a,e);
+    casio_big_shift(&a,b+e);
+  } else {
+    casio_big_shift(&a,b+e);
+    casio_big_div5(&a,-e);
+  }
+  casio_scaled r=0;
+  for( byte i=a.n; i-->0; ) r=r<<16|a.w[i];
+  return r;
+}
+
+inline bool casio_scaled_ge(casio_scaled s, casio_mantissa m)
+{
+  return s>=2*(casio_scaled)m;
+}
+
+// nearest integer, halves rounded up
+casio_mantissa casio_scaled_round(casio_scaled s)
+{
+  return (s+1)>>1;
+}
+
+// nearest float to m*10^e
+double casio_decimal(casio_mantissa m, int e)
+{
+  casio_big a;
+  casio_big_set(&a,m);
+  if( e>=0 ) {
+    if( e>38 ) return INFINITY; // m is at least 1
+    casio_big_mul5(&a,e);
+    return casio_big_float(&a,e,false);
   }
-  Serial.print("\n");
+  // below 2^-150 even with 10 digits
+  if( e<=-55 ) return 0.0;
+  // room for 27 bits or more of the quotient, 2378/1024>log2(5)
+  int k=28+(-e*2378>>10);
+  casio_big_shift(&a,k);
+  bool rest=casio_big_div5(&a,-e);
+  return casio_big_float(&a,e-k,rest);
 }
 #endif
 
 // Convert Arduino floating point number into 10-byte CASIO buffer format
 byte *casio_number_format(byte *buffer, double value)
 {
-  char fmtbuf[32];
-  int sign=0;
-#ifdef CASIO_DEBUG_V
-  Serial.print("Formatting ");
-  Serial.println(value);
-#endif
-  /*
-   * If non-restricted sprintf and 8-byte double were available, the formating
-   * procedure would look like this:
-  sprintf(fmtbuf,"%-#.14e",value);
-  Serial.print("fmtbuf=");
-  Serial.println(fmtbuf);
-   * 0..15 -- mantissa (including decimal point)
-   * 16,17 -- "e+"
-   * 18..20 -- exp
-   */
-
-   /*
-   * Arduino's printf does not format floats
-   * Also, Arduino's doubles are actually floats (4 bytes ieee)
-dtostre formatting=+9.8765000e+32
-   * 0=sign
-   * 1..9 = digits of mantissa
-   * 10="e"
-   * 11=exponent sign
-   * 12..13=exponent
-   */
-  dtostre(value,fmtbuf,20,DTOSTR_ALWAYS_SIGN|DTOSTR_PLUS_SIGN);
-  if( fmtbuf[0]=='-' ) {
-    sign=sign|CASIO_NEG;
-  }
-  int exp;
-  if( fmtbuf[1]=='i' ) {
-    goto OVERFLOW;
+  byte sign=0;
+  int exp=0;
+  casio_mantissa m;
+  memset(buffer,0,8);
+  if( value<0 ) {
+    sign=CASIO_NEG;
+    value=-value;
+  }
+  if( isnan(value) || isinf(value) ) goto OVERFLOW;
+  if( value==0.0 ) {
+    sign=CASIO_EXPPOS;
+    goto DONE;
+  }
+  // decimal exponent estimated from the binary one, log10(2)~=77/256
+  // frexp() also normalizes subnormals
+  frexp(value,&exp);
+  exp=((exp-1)*77)>>8;
+  // way out of the calculator's range, the estimate is at most one short
+  if( exp>100 ) goto OVERFLOW;
+  if( exp<-101 ) goto UNDERFLOW;
+  {
+    casio_scaled scaled=casio_scale10(value,CASIO_DIGITS-1-exp);
+    // the estimate may be one off, scale again rather than round twice
+    if( casio_scaled_ge(scaled,CASIO_MANTISSA_LIM) )
+      scaled=casio_scale10(value,CASIO_DIGITS-1-(++exp));
+    else if( !casio_scaled_ge(scaled,CASIO_MANTISSA_MIN) )
+      scaled=casio_scale10(value,CASIO_DIGITS-1-(--exp));
+    m=casio_scaled_round(scaled);
+  }
+  if( m>=CASIO_MANTISSA_LIM ) {
+    // rounded up to the next power of ten
+    m/=10;
+    ++exp;
+  }
+  if( exp>99 ) goto OVERFLOW;
+  if( exp<-99 ) {
+UNDERFLOW:
+    // CAUTION: underflow, flush to zero
+    sign=CASIO_EXPPOS;
+    exp=0;
+    goto DONE;
+  }
+  // d0 goes to the low nibble of byte 0, then pairs of digits
+  for( int i=(CASIO_DIGITS-1)/2; i>0; --i ) {
+    buffer[i]=bcd(m%100);
+    m/=100;
+  }
+  buffer[0]=m;
+  if( exp>=0 ) {
+    sign|=CASIO_EXPPOS;
   } else {
-    buffer[0]=fmtbuf[1] & 0x0f;
-    
-    for(int i=1; i<4;++i) {
-      buffer[i]=((fmtbuf[1+2*i]&0x0f)<<4)|((fmtbuf[2+2*i]&0x0f));
-    }
-    buffer[4]=(fmtbuf[9]&0x0f)<<4;
-    exp=(fmtbuf[12]-'0')*10+(fmtbuf[13]-'0');
-    if(fmtbuf[11]=='-') {
-      exp=100-exp;
-      if(exp<1) {
-        // CAUTION: undeflow
-        exp=0;
-        memset(&buffer[0],0x00,8);
-      }
-    } else {
-      sign=sign|CASIO_EXPPOS;
-    }
-    if(exp>99) {
-      // Cannot happen on Arduino, but might happen on platform with 8 byte
-      // double.
-OVERFLOW:
-      // CAUTION: overflow
-      exp=99;
-      memset(&buffer[1],0x99,7);
-      buffer[0]=0x09;
-    }
+    exp=100+exp;
   }
+  goto DONE;
+OVERFLOW:
+  // CAUTION: overflow
+  sign|=CASIO_EXPPOS;
+  exp=99;
+  memset(&buffer[1],0x99,7);
+  buffer[0]=0x09;
+DONE:
   buffer[8]=sign;
   buffer[9]=bcd(exp);
-#ifdef CASIO_DEBUG_V
-  Serial.print("Buffer=");
-  serial_dump(buffer,10);
-  Serial.print("\n");
-#endif
-  return buffer; 
+  return buffer;
 }
 
 /* 
@@ -329,28 +1229,21 @@ OVERFLOW:
 // floating point number.
 double casio_number_parse(byte *buffer)
 {
-  int i;
-  double r=0.0;
   int exp,sign;
-#ifdef CASIO_DEBUG_V
-  Serial.print("Parse");
-  serial_dump(buffer,10);
+  // only as many digits as a double holds, rounded by the next one
+  casio_mantissa m=buffer[0] & 0x0f;
+  int i;
+  for( i=1; i<=(CASIO_DIGITS-1)/2; ++i ) m=m*100+fbcd(buffer[i]);
+#if CASIO_DIGITS<15
+  if( (buffer[i]>>4)>=5 ) ++m;
 #endif
-  for( i=0; i<8; ++i ) r=r*100.0+fbcd(buffer[i]);
-  r=r/1e14;
+  if( 0==m ) return 0.0;
   sign=buffer[8];
   exp=fbcd(buffer[9]);
-#ifdef CASIO_DEBUG_V
-  Serial.print("mantissa=");
-  Serial.println(r);
-  Serial.print("exp=");
-  Serial.println(exp);
-  Serial.print("sign=");
-  Serial.println(sign);
-#endif
   if( 0==(sign & CASIO_EXPPOS) ) exp=exp-100;
+  double r=casio_decimal(m,exp-(CASIO_DIGITS-1));
   if( 0!=(sign & CASIO_NEG ) ) r=-r;
-  return r*pow(10.0,exp);
+  return r;
 }
 
 const char TAG_VM[] PROGMEM = {'V','M'}; // named variable
@@ -362,55 +1255,274 @@ const char TAG_Variable[] PROGMEM = {'V','a','r','i','a','b','l','e'};
 /* Lists have "List n" or "List nn"
  * Matrices have "Mat N" at this offset
  */
+const char NAME_LIST[] PROGMEM = {'L','i','s','t',' '};
+const char NAME_MAT[] PROGMEM = {'M','a','t',' '};
+
+// 2-byte big endian number in a packet
+int casio_word(byte *buffer)
+{
+  return (buffer[0]<<8)|buffer[1];
+}
+
+void casio_set_word(byte *buffer, int v)
+{
+  buffer[0]=v>>8;
+  buffer[1]=v;
+}
+
+// number n of a "List n" name field, 0 if it is not a list name
+byte cccp_list_number(byte *name)
+{
+  byte n=0;
+  if( 0!=memcmp_P(name,NAME_LIST,5) ) return 0;
+  for( int i=5; i<8 && name[i]>='0' && name[i]<='9'; ++i ) n=n*10+name[i]-'0';
+  return n;
+}
+
+// letter X of a "Mat X" name field, 0 if it is not a matrix name
+char cccp_matrix_name(byte *name)
+{
+  if( 0!=memcmp_P(name,NAME_MAT,4) ) return 0;
+  if( name[4]<'A' || name[4]>'Z' ) return 0;
+  return name[4];
+}
 
+#ifdef CASIO_ARRAYS
+// :VAL/:REQ header of a list or a matrix
+int cccp_analyze_array_header(CasioHeader *h)
+{
+  bool val=CASIO_VAL==h->type;
+  cccp->array_immediate=true;
+  cccp->element=0;
+#ifdef CASIO_LISTS
+  cccp->listbox=NULL;
+  if( CASIO_LT==h->rank ) {
+    cccp->listbox=get_listbox(val?CCCP_BOXES(list_inboxes):CCCP_BOXES(list_outboxes), h->name);
+    if( NULL!=cccp->listbox ) {
+      cccp->array_fresh=&cccp->listbox->fresh;
+      cccp->array_immediate=cccp->listbox->immediate;
+      cccp->array_timeout=cccp->listbox->timeout;
+    }
+  } else
+#endif
+#ifdef CASIO_MATRICES
+  if( CASIO_MT==h->rank ) {
+    cccp->matrixbox=get_matrixbox(val?CCCP_BOXES(matrix_inboxes):CCCP_BOXES(matrix_outboxes), h->name);
+    if( NULL!=cccp->matrixbox ) {
+      cccp->array_fresh=&cccp->matrixbox->fresh;
+      cccp->array_immediate=cccp->matrixbox->immediate;
+      cccp->array_timeout=cccp->matrixbox->timeout;
+      if( val ) {
+        cccp->matrixbox->rows=h->rows;
+        cccp->matrixbox->cols=h->cols;
+      }
+    }
+  } else
+#endif
+    return CCCP_NACK; // not compiled in
+#ifdef CASIO_MATRICES
+  if( CASIO_MT!=h->rank ) cccp->matrixbox=NULL;
+#endif
+  if( !val ) return CCCP_RECEIVE_WAITDATA;
+  // SEND(): element packets follow, each acknowledged
+  cccp->elements=h->rows*h->cols;
+  cccp->buffer_size=0==cccp->elements ? 0
+    : h->complex?CASIO_C_SIZE:CASIO_R_SIZE;
+  return CCCP_SEND_ACK1;
+}
+
+// one element of an incoming list or matrix, checksum is already verified
+int cccp_analyze_element(byte *buffer)
+{
+  if( buffer[0]!=':' ) return CCCP_NACK;
+  int row=casio_word(&buffer[1]);
+#ifdef CASIO_LISTS
+  if( NULL!=cccp->listbox && row>=1 && row<=cccp->listbox->capacity )
+    cccp->listbox->data[row-1]=casio_number_parse(&buffer[CASIO_B_RE]);
+#endif
+#ifdef CASIO_MATRICES
+  if( NULL!=cccp->matrixbox && NULL!=cccp->matrixbox->put )
+    (*cccp->matrixbox->put)(cccp->matrixbox, row, casio_word(&buffer[3])
+      , casio_number_parse(&buffer[CASIO_B_RE]));
+#endif
+  if( ++cccp->element<cccp->elements ) return CCCP_SEND_NEXTDATA;
+#ifdef CASIO_LISTS
+  if( NULL!=cccp->listbox )
+    cccp->listbox->size=cccp->elements<cccp->listbox->capacity?cccp->elements:cccp->listbox->capacity;
+#endif
+  if( NULL!=cccp->array_fresh ) *cccp->array_fresh=true;
+  return CCCP_SEND_EXECUTEDATA;
+}
+
+// turn :VAL template in buffer into a header of the requested list or matrix
+void cccp_array_header(byte *buffer)
+{
+  int rows=0;
+  byte n=cccp->varname;
+  cccp->cols=1;
+#ifdef CASIO_LISTS
+  if( CASIO_LT==cccp->rank ) {
+    int i=CASIO_B_NAME+5;
+    if( NULL!=cccp->listbox ) rows=cccp->listbox->size;
+    memcpy_P(&buffer[CASIO_B_RANK],TAG_LT,2);
+    memcpy_P(&buffer[CASIO_B_NAME],NAME_LIST,5);
+    if( n>=10 ) buffer[i++]='0'+n/10;
+    buffer[i]='0'+n%10;
+  }
+#endif
+#ifdef CASIO_MATRICES
+  if( CASIO_MT==cccp->rank ) {
+    if( NULL!=cccp->matrixbox && NULL!=cccp->matrixbox->get ) {
+      rows=cccp->matrixbox->rows;
+      cccp->cols=cccp->matrixbox->cols;
+    }
+    memcpy_P(&buffer[CASIO_B_RANK],TAG_MT,2);
+    memcpy_P(&buffer[CASIO_B_NAME],NAME_MAT,4);
+    buffer[CASIO_B_NAME+4]=n;
+  }
+#endif
+  cccp->elements=rows*cccp->cols;
+  cccp->element=0;
+  casio_set_word(&buffer[CASIO_B_ROWS],rows);
+  casio_set_word(&buffer[CASIO_B_COLS],cccp->cols);
+  buffer[CASIO_B_CHECKSUM]=casio_checksum(buffer,CASIO_B_SIZE-1);
+}
+
+// value of the element being sent
+double cccp_array_element(byte *buffer)
+{
+  int row=cccp->element/cccp->cols+1;
+  int col=cccp->element%cccp->cols+1;
+  casio_set_word(&buffer[1],row);
+  casio_set_word(&buffer[3],col);
+#ifdef CASIO_LISTS
+  if( CASIO_LT==cccp->rank ) return cccp->listbox->data[cccp->element];
+#endif
+#ifdef CASIO_MATRICES
+  if( CASIO_MT==cccp->rank ) return (*cccp->matrixbox->get)(cccp->matrixbox, row, col);
+#endif
+  return CASIO_DEFAULT_VALUE;
+}
+#endif
+
+
+// Bad checksum: ask for the packet again and wait for it in state next.
+// After CASIO_RETRIES attempts the request is rejected.
+int cccp_resend(int next)
+{
+  CCCP_STAT(checksum_errors);
+  if( cccp->retries>=CASIO_RETRIES ) return CCCP_NACK;
+  CCCP_LOG(WARNING, RESEND, 0, cccp->buffer, 5);
+  ++cccp->retries;
+  cccp->resend_state=next;
+  return CCCP_RESEND;
+}
+
+bool casio_parse_header(byte *buffer, CasioHeader *h)
+{
+  if( 0==memcmp_P(&buffer[0],HEADER_VAL,5) ) h->type=CASIO_VAL;
+  else if( 0==memcmp_P(&buffer[0],HEADER_REQ,5) ) h->type=CASIO_REQ;
+  else if( 0==memcmp_P(&buffer[0],HEADER_END,5) ) h->type=CASIO_END;
+  else return false;
+  h->rank=CASIO_VM;
+  h->name=0;
+  h->rows=casio_word(&buffer[CASIO_B_ROWS]);
+  h->cols=casio_word(&buffer[CASIO_B_COLS]);
+  h->complex=buffer[CASIO_B_COMPLEX]=='C';
+  if( CASIO_END==h->type ) return true;
+  if( 0==memcmp_P(&buffer[CASIO_B_RANK],TAG_VM,2) ) {
+    h->name=buffer[CASIO_B_NAME];
+    // "used" bytes: 1 if a value follows, 0 if the variable is not assigned
+    if( CASIO_VAL==h->type
+    && (buffer[CASIO_B_USED1]!=buffer[CASIO_B_USED2] || buffer[CASIO_B_USED1]>1) )
+      return false;
+    return true;
+  }
+  if( 0==memcmp_P(&buffer[CASIO_B_RANK],TAG_LT,2) ) {
+    h->rank=CASIO_LT;
+    h->name=cccp_list_number(&buffer[CASIO_B_NAME]);
+  } else if( 0==memcmp_P(&buffer[CASIO_B_RANK],TAG_MT,2) ) {
+    h->rank=CASIO_MT;
+    h->name=cccp_matrix_name(&buffer[CASIO_B_NAME]);
+  }
+  return 0!=h->name;
+}
+
+/* Unknown names are logged here rather than in get_mailbox(), which the
+ * firmware calls too: with casio_poll() in an interrupt the log would have
+ * a second writer.
+ */
+void cccp_log_lookup()
+{
+#ifdef CCCP_FAKEBOX
+  if( &fakebox==cccp->actionbox )
+    CCCP_LOG(WARNING, NO_MAILBOX, cccp->varname, NULL, 0);
+#endif
+  if( NULL==cccp->actionbox ) CCCP_LOG(WARNING, NO_MAILBOX, cccp->varname, NULL, 0);
+}
 
 int cccp_analyze_header(byte *buffer)
 {
   // :END -> idle
   // :REQ -> CCCP_RECEIVE_WAITDATA
   // :VAL -> CCCP_SEND_ACK1
-  // setup cccp_actionbox
-#ifdef CASIO_DEBUG_V
-  Serial.print("Received header ");
-  serial_dump(buffer, CASIO_B_SIZE);
-#endif
-  // TODO: request resend instead of NACK
-  if( buffer[CASIO_B_CHECKSUM]!=casio_checksum(buffer, CASIO_B_SIZE-1) ) goto REJECT_HEADER;
-  if( 0==memcmp_P(&buffer[0],HEADER_END,5) ) return CCCP_IDLE;
-  if( 0==memcmp_P(&buffer[0],HEADER_VAL,5) ) {
+  // setup cccp->actionbox
+  CasioHeader h;
+  CCCP_LOG(DEBUG, HEADER, 0, buffer, CASIO_B_SIZE);
+  if( buffer[CASIO_B_CHECKSUM]!=casio_checksum(buffer, CASIO_B_SIZE-1) ) {
+    int next=cccp_resend(CCCP_GETHEADER0);
+    if( CCCP_NACK!=next ) return next;
+    goto REJECT_HEADER;
+  }
+  cccp->retries=0;
+  if( !casio_parse_header(buffer, &h) ) goto REJECT_HEADER;
+  if( CASIO_END==h.type ) return CCCP_IDLE;
+  cccp->rank=h.rank;
+  cccp->varname=h.name;
+  cccp->actionbox=NULL;
+#ifdef CASIO_GROUPS
+  cccp->groupbox=NULL;
+#endif
+#ifdef CASIO_ARRAYS
+  cccp->array_fresh=NULL;
+  if( CASIO_VM!=h.rank ) {
+    int next=cccp_analyze_array_header(&h);
+    if( CCCP_NACK!=next ) return next;
+    goto REJECT_HEADER;
+  }
+#endif
+  if( CASIO_VM!=h.rank ) goto REJECT_HEADER;
+  if( CASIO_VAL==h.type ) {
     // :VAL, AKA SEND() request
     // :0101 packet with actual data possibly to follow
-    if( 0!=memcmp_P(&buffer[CASIO_B_RANK],TAG_VM,2) ) goto REJECT_HEADER;
-    cccp_actionbox=get_inbox(buffer[CASIO_B_NAME]);
-    cccp_varname=buffer[CASIO_B_NAME];
-    if( buffer[CASIO_B_USED1]!=buffer[CASIO_B_USED2] ) goto REJECT_HEADER;
-    switch(buffer[CASIO_B_USED1]) {
-      case 0:
-        // variable has not been assigned yet, no :0101 to follow
-        cccp_buffer_size=0;
-        break;
-      case 1:
-        // size of expected :0101 packet
-        cccp_buffer_size=buffer[CASIO_B_COMPLEX]=='C'?26:16;
-        break;
-      default:
-        goto REJECT_HEADER;
-    }
+    cccp->actionbox=NULL==cccp->inboxes ? get_inbox(h.name, CCCP_CREATE)
+      : get_mailbox(&cccp->inboxes, h.name, CCCP_CREATE);
+    cccp_log_lookup();
+    // no :0101 follows if the variable has not been assigned yet
+    cccp->buffer_size=0==h.rows ? 0 : h.complex?CASIO_C_SIZE:CASIO_R_SIZE;
     return CCCP_SEND_ACK1;
   }
-  if( 0==memcmp_P(&buffer[0],HEADER_REQ,5) ) {
-    // :REQ, AKA RECEIVE() request
-    if( 0!=memcmp_P(&buffer[CASIO_B_RANK],TAG_VM,2) ) goto REJECT_HEADER;
-    cccp_actionbox=get_outbox(buffer[CASIO_B_NAME]);
-    cccp_varname=buffer[CASIO_B_NAME];
-    if( NULL!=casio_receive_hook ) (*casio_receive_hook)(cccp_varname);
+  // :REQ, AKA RECEIVE() request
+#ifdef CASIO_GROUPS
+  cccp->groupbox=get_groupbox(CCCP_BOXES(group_outboxes), h.name, &cccp->group_slot);
+  if( NULL!=cccp->groupbox ) {
+    cccp_group_request();
+    if( NULL!=casio_receive_hook ) (*casio_receive_hook)(cccp->varname);
     return CCCP_RECEIVE_WAITDATA;
   }
-REJECT_HEADER:
-#ifdef CASIO_DEBUG
-  Serial.print("!Reject header ");
-  serial_dump(buffer, CASIO_B_SIZE);
 #endif
+  cccp->actionbox=NULL==cccp->outboxes ? get_outbox(h.name, CCCP_CREATE)
+    : get_mailbox(&cccp->outboxes, h.name, CCCP_CREATE);
+  cccp_log_lookup();
+  if( NULL!=cccp->actionbox && NULL!=cccp->actionbox->produce ) {
+    // the value is made for this request
+    cccp->actionbox->fresh=false;
+    (*cccp->actionbox->produce)(cccp->actionbox);
+  }
+  if( NULL!=casio_receive_hook ) (*casio_receive_hook)(cccp->varname);
+  return CCCP_RECEIVE_WAITDATA;
+REJECT_HEADER:
+  CCCP_LOG(ERROR, REJECT_HEADER, 0, buffer, CASIO_B_SIZE);
   return CCCP_NACK;
 }
 
@@ -420,230 +1532,561 @@ int cccp_analyze_senddata(byte* buffer, size_t buffer_size)
   // decode value
   // populate actionbox
   // move on to CCCP_SEND_EXECUTEDATA
-#ifdef CASIO_DEBUG_V
-  Serial.print("senddata: ");
-  serial_dump(buffer,buffer_size);
-#endif
+  CCCP_LOG(DEBUG, DATA, 0, buffer, buffer_size);
 
-  if( buffer[buffer_size-1]!=casio_checksum(buffer, buffer_size-1) ) goto REJECT;
+  if( buffer[buffer_size-1]!=casio_checksum(buffer, buffer_size-1) ) {
+    int next=cccp_resend(CCCP_SEND_WAITDATA0);
+    if( CCCP_NACK!=next ) return next;
+    goto REJECT;
+  }
+  cccp->retries=0;
+#ifdef CASIO_ARRAYS
+  if( CASIO_VM!=cccp->rank ) {
+    int next=cccp_analyze_element(buffer);
+    if( CCCP_NACK!=next ) return next;
+    goto REJECT;
+  }
+#endif
   if( 0!=memcmp_P(&buffer[0],HEADER_0101,5) ) goto REJECT;
-  if( NULL!=cccp_actionbox ) {
-    cccp_actionbox->value=casio_number_parse(&buffer[CASIO_B_RE]);
-    // TODO? deal with imaginary part if present
-    cccp_actionbox->fresh=true;
+#ifdef CASIO_QUEUES
+  if( NULL!=cccp->actionbox && NULL!=cccp->actionbox->queue ) {
+    // enqueued from the buffer in CCCP_SEND_EXECUTEDATA, where the
+    // calculator can be held
+    cccp->queued=true;
+  } else
+#endif
+  if( NULL!=cccp->actionbox ) {
+    cccp->actionbox->value=casio_to_value(casio_number_parse(&buffer[CASIO_B_RE]));
+#ifdef CASIO_COMPLEX
+    cccp->actionbox->im=buffer_size==CASIO_C_SIZE
+      ? casio_to_value(casio_number_parse(&buffer[CASIO_B_IM])) : 0;
+#endif
+    cccp->actionbox->fresh=true;
+    cccp_mark_fresh();
   }
   return CCCP_SEND_EXECUTEDATA;
 REJECT:
-#ifdef CASIO_DEBUG
-  Serial.print("!Reject senddata ");
-  serial_dump(buffer, buffer_size);
-#endif
+  CCCP_LOG(ERROR, REJECT_DATA, 0, buffer, buffer_size);
   return CCCP_NACK;
 }
 
 
-long int last_change;
-int last_state;
+// Read bytes of an incoming packet into cccp->buffer, no more than the
+// packet needs. Returns false if there was nothing to read.
+bool cccp_receive_bytes()
+{
+#ifdef CASIO_BLOCK_IO
+  int n=cccp->serial->available();
+  if( n>cccp->buffer_size-cccp->buffer_index ) n=cccp->buffer_size-cccp->buffer_index;
+  if( n<=0 ) return false;
+  n=cccp->serial->readBytes(cccp->buffer+cccp->buffer_index, n);
+#else
+  if( 0==cccp->serial->available() ) return false;
+  cccp->buffer[cccp->buffer_index]=cccp->serial->read();
+  int n=1;
+#endif
+  cccp->buffer_index+=n;
+  cccp->progress=true;
+  CCCP_STAT_ADD(bytes_in,n);
+  return true;
+}
 
-void casio_poll()
+// bytes of a program memory packet staged on the stack per write()
+#define CASIO_TX_CHUNK 16
+
+// Write bytes of the outgoing packet, no more than the port accepts without
+// blocking. Returns false if the port is full.
+bool cccp_transmit_bytes()
 {
-  if( NULL==casio_serial ) return;
-  int rd;
-  if( cccp_state!=last_state ){
-    last_change=millis();
+#ifdef CASIO_BLOCK_IO
+  int n=cccp->serial->availableForWrite();
+  if( n>cccp->buffer_size-cccp->buffer_index ) n=cccp->buffer_size-cccp->buffer_index;
+  if( n<=0 ) return false;
+  if( NULL==cccp->tx_flash ) {
+    n=cccp->serial->write(cccp->buffer+cccp->buffer_index, n);
   } else {
-    if( cccp_state!=CCCP_IDLE && millis()>last_change+6000 ) {
-      Serial.print("Stuck in state ");
-      Serial.println(cccp_state);
-      last_change=millis();
-    }
+    byte chunk[CASIO_TX_CHUNK];
+    if( n>CASIO_TX_CHUNK ) n=CASIO_TX_CHUNK;
+    memcpy_P(chunk, cccp->tx_flash+cccp->buffer_index, n);
+    n=cccp->serial->write(chunk, n);
+  }
+#else
+  if( 0==cccp->serial->availableForWrite() ) return false;
+  int n=cccp->serial->write(NULL==cccp->tx_flash ? cccp->buffer[cccp->buffer_index]
+    : pgm_read_byte(cccp->tx_flash+cccp->buffer_index));
+#endif
+  cccp->buffer_index+=n;
+  CCCP_STAT_ADD(bytes_out,n);
+  return true;
+}
+
+// single control bytes
+int cccp_read()
+{
+  cccp->progress=true;
+  CCCP_STAT(bytes_in);
+  return cccp->serial->read();
+}
+
+void cccp_write(byte b)
+{
+  CCCP_STAT(bytes_out);
+  cccp->serial->write(b);
+}
+
+void cccp_poll();
+
+// True once the calculator has been on hold for timeout ms, 0 holds forever.
+// The hold starts on the first call in a hold state.
+bool cccp_hold_expired(unsigned int timeout)
+{
+  CasioMillis now=millis();
+  if( cccp->state!=cccp->last_state ) {
+    cccp->last_state=cccp->state;
+    cccp->last_change=now;
+  }
+  if( 0==timeout || (CasioMillis)(now-cccp->last_change)<timeout ) return false;
+  CCCP_STAT(expired);
+  CCCP_LOG(WARNING, EXPIRED, cccp->state, NULL, 0);
+  return true;
+}
+
+void cccp_reset_session(CasioSession *session, Stream *port)
+{
+  memset(session, 0, sizeof(CasioSession));
+  session->serial=port;
+  session->state=CCCP_IDLE;
+  session->last_state=CCCP_IDLE;
+#ifdef CASIO_STATS
+  session->stat_state=CCCP_IDLE;
+  session->stat_since=micros();
+#endif
+}
+
+void casio_add_session(CasioSession *session, Stream *port)
+{
+  cccp_reset_session(session, port);
+  session->next=casio_sessions;
+  casio_sessions=session;
+}
+
+/* casio_poll() or casio_poll_session() is running (CCCP_RUNNING), and it
+ * has been called again meanwhile (CCCP_PENDING), e.g. from an interrupt.
+ * Both bits are tested and changed at once, so a call made while the
+ * running one is about to leave is either seen by it or runs itself.
+ */
+#define CCCP_RUNNING 1
+#define CCCP_PENDING 2
+volatile byte cccp_poll_state;
+
+// true if the caller is to poll, false if the running one will poll again
+bool cccp_poll_enter()
+{
+#ifdef __AVR__
+  bool enter;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    enter=0==(cccp_poll_state & CCCP_RUNNING);
+    cccp_poll_state=enter?CCCP_RUNNING:CCCP_RUNNING|CCCP_PENDING;
   }
-  last_state=cccp_state;
-  while(true) switch(cccp_state){
+  return enter;
+#else
+  byte state=__atomic_load_n(&cccp_poll_state, __ATOMIC_RELAXED);
+  byte next;
+  do {
+    next=(state & CCCP_RUNNING)?CCCP_RUNNING|CCCP_PENDING:CCCP_RUNNING;
+  } while( !__atomic_compare_exchange_n(&cccp_poll_state, &state, next, true,
+    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) );
+  return 0==(state & CCCP_RUNNING);
+#endif
+}
+
+// true if done, false if called meanwhile and to poll again
+bool cccp_poll_leave()
+{
+#ifdef __AVR__
+  bool done;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    done=0==(cccp_poll_state & CCCP_PENDING);
+    cccp_poll_state=done?0:CCCP_RUNNING;
+  }
+  return done;
+#else
+  byte state=CCCP_RUNNING;
+  if( __atomic_compare_exchange_n(&cccp_poll_state, &state, 0, false,
+    __ATOMIC_RELEASE, __ATOMIC_RELAXED) ) return true;
+  __atomic_store_n(&cccp_poll_state, CCCP_RUNNING, __ATOMIC_RELAXED);
+  return false;
+#endif
+}
+
+void cccp_poll_session(CasioSession *session);
+
+void cccp_poll_all()
+{
+  // the built-in session starts over when casio_serial is changed
+  if( cccp_default.serial!=casio_serial )
+    cccp_reset_session(&cccp_default, casio_serial);
+  if( NULL!=casio_serial ) cccp_poll_session(&cccp_default);
+  for( CasioSession *s=casio_sessions; NULL!=s; s=s->next )
+    cccp_poll_session(s);
+}
+
+void casio_poll()
+{
+  if( !cccp_poll_enter() ) return;
+  do cccp_poll_all(); while( !cccp_poll_leave() );
+}
+
+void casio_poll_session(CasioSession *session)
+{
+  if( !cccp_poll_enter() ) return;
+  cccp_poll_session(session);
+  // whoever called meanwhile may have wanted any session
+  while( !cccp_poll_leave() ) cccp_poll_all();
+}
+
+bool cccp_session_idle(CasioSession *session)
+{
+  return NULL==session->serial
+    || (CCCP_IDLE==session->state && 0==session->serial->available());
+}
+
+bool casio_idle()
+{
+  if( 0!=cccp_poll_state ) return false;
+  if( NULL!=casio_serial && cccp_default.serial==casio_serial
+  && !cccp_session_idle(&cccp_default) ) return false;
+  for( CasioSession *s=casio_sessions; NULL!=s; s=s->next )
+    if( !cccp_session_idle(s) ) return false;
+  return true;
+}
+
+uint32_t casio_take_fresh(CasioSession *session)
+{
+  if( NULL!=session ) return cccp_take_fresh(session);
+  uint32_t bits=cccp_take_fresh(&cccp_default);
+  for( CasioSession *s=casio_sessions; NULL!=s; s=s->next )
+    bits|=cccp_take_fresh(s);
+  return bits;
+}
+
+CasioMailBox *casio_next_fresh(uint32_t *bits, CasioMailBox *head)
+{
+  while( 0!=*bits ) {
+    int i=__builtin_ctzl(*bits);
+    *bits&=~((uint32_t)1<<i);
+    char name=casio_index_name(i);
+    CasioMailBox *box=NULL==head?get_inbox(name):get_mailbox(&head, name);
+#ifdef CCCP_FAKEBOX
+    if( &fakebox==box ) continue;
+#endif
+    if( NULL!=box ) return box;
+  }
+  return NULL;
+}
+
+void cccp_poll_session(CasioSession *session)
+{
+  if( NULL==session->serial ) return;
+  cccp=session;
+  CasioMillis now=millis();
+  if( cccp->state!=cccp->last_state || cccp->progress ) {
+    cccp->last_change=now;
+    cccp->progress=false;
+  } else if( cccp->state!=CCCP_IDLE
+  && cccp->state!=CCCP_SEND_EXECUTEDATA // holds have timeouts of their own
+  && cccp->state!=CCCP_RECEIVE_WAITDATA
+  && (CasioMillis)(now-cccp->last_change)>=CASIO_TIMEOUT
+  // bytes that came in while loop() was busy are read first
+  && 0==cccp->serial->available() ) {
+    CCCP_LOG(ERROR, TIMEOUT, cccp->state, NULL, 0);
+    CCCP_STAT(timeouts);
+    cccp->state=CCCP_IDLE;
+  }
+  cccp->last_state=cccp->state;
+  cccp_poll();
+#ifdef CASIO_STATS
+  cccp_stat_track();
+#endif
+}
+
+// protocol state machine, returns when it has to wait for the port or the
+// firmware
+void cccp_poll()
+{
+  int rd;
+  while(true) switch(cccp->state){
     case CCCP_IDLE:
-      if( 0==casio_serial->available() ) return;
-      if( casio_serial->read()==CASIO_ATT ) cccp_state=CCCP_ALERT;
+      if( 0==cccp->serial->available() ) return;
+      if( cccp_read()==CASIO_ATT ) cccp->state=CCCP_ALERT;
       break;
     case CCCP_ALERT:
-      if( 0==casio_serial->availableForWrite() ) return;
-      casio_serial->write(CASIO_READY);
+      if( 0==cccp->serial->availableForWrite() ) return;
+      cccp_write(CASIO_READY);
+      cccp->retries=0;
+#ifdef CASIO_QUEUES
+      cccp->queued=false;
+#endif
 
     case CCCP_GETHEADER0:
-      cccp_buffer_index=0;
-      cccp_buffer_size=CASIO_B_SIZE;
-      cccp_state=CCCP_GETHEADER;
+      cccp->buffer_index=0;
+      cccp->buffer_size=CASIO_B_SIZE;
+      cccp->state=CCCP_GETHEADER;
     case CCCP_GETHEADER:
-      // TODO: timeout
-      if( 0==casio_serial->available() ) return;
-      cccp_buffer[cccp_buffer_index++]=casio_serial->read();
-      if( cccp_buffer_index>=cccp_buffer_size )
-        cccp_state=cccp_analyze_header(cccp_buffer);
+      // CASIO_TIMEOUT applies, see cccp_poll_session()
+      if( !cccp_receive_bytes() ) return;
+      if( cccp->buffer_index>=cccp->buffer_size )
+        cccp->state=cccp_analyze_header(cccp->buffer);
       break;
 
     case CCCP_SEND_ACK1:
-      if( 0==casio_serial->availableForWrite() ) return;
-      casio_serial->write(CASIO_ACK);
-      if( cccp_buffer_size==0 ) {
+      if( 0==cccp->serial->availableForWrite() ) return;
+      cccp_write(CASIO_ACK);
+      if( cccp->buffer_size==0 ) {
         // not expecting :0101, jump right to :END
-        cccp_state=CCCP_GETHEADER0;
+        cccp->state=CCCP_GETHEADER0;
         break;
       }
 
     case CCCP_SEND_WAITDATA0:
-      cccp_buffer_index=0;
-      // cccp_buffer_size should be set by cccp_analyze_header;
-      cccp_state=CCCP_SEND_WAITDATA;
+      cccp->buffer_index=0;
+      // cccp->buffer_size should be set by cccp_analyze_header;
+      cccp->state=CCCP_SEND_WAITDATA;
     case CCCP_SEND_WAITDATA:
       // expecting :0101
-      if( 0==casio_serial->available() ) return;
-      cccp_buffer[cccp_buffer_index++]=casio_serial->read();
-      if( cccp_buffer_index>=cccp_buffer_size )
-        cccp_state=cccp_analyze_senddata(cccp_buffer,cccp_buffer_size);
+      if( !cccp_receive_bytes() ) return;
+      if( cccp->buffer_index>=cccp->buffer_size )
+        cccp->state=cccp_analyze_senddata(cccp->buffer,cccp->buffer_size);
+      break;
+
+    case CCCP_SEND_NEXTDATA:
+      // acknowledge an element of a list, more are to follow
+      if( 0==cccp->serial->availableForWrite() ) return;
+      cccp_write(CASIO_ACK);
+      cccp->state=CCCP_SEND_WAITDATA0;
       break;
 
     case CCCP_SEND_EXECUTEDATA:
+#ifdef CASIO_QUEUES
+      if( cccp->queued && NULL!=cccp->actionbox ) {
+        // wait for room in the queue, drop the value once the hold expires;
+        // only a value that got in makes the box fresh
+        if( cccp_queue_put(cccp->actionbox->queue) ) {
+          cccp->actionbox->fresh=true;
+          cccp_mark_fresh();
+        } else {
+          if( !cccp_hold_expired(cccp->actionbox->timeout) ) return;
+          ++cccp->actionbox->queue->dropped;
+        }
+        cccp->queued=false;
+      }
+#endif
       // CAUTION: make sure that non-immediate mailboxes are properly acted
       // upon by firmware and the freshness bit is cleared when that happens.
-      // TODO? timed-out actionboxes
-      if( NULL!=cccp_actionbox
-      && !cccp_actionbox->immediate
-      && cccp_actionbox->fresh )
+      if( NULL!=cccp->actionbox
+      && !cccp->actionbox->immediate
+      && cccp->actionbox->fresh
+      && !cccp_hold_expired(cccp->actionbox->timeout) )
         return; // keep calc on hold while data is executing
+#ifdef CASIO_ARRAYS
+      if( NULL!=cccp->array_fresh
+      && !cccp->array_immediate
+      && *cccp->array_fresh
+      && !cccp_hold_expired(cccp->array_timeout) )
+        return;
+#endif
       // CAUTION: it is possible that once the freshness conditions are
       // satisfied, the out queue is full and while we are waiting for it to
       // clear, freshness conditions may become not satisfied. It should not
       // happen: immediate flag should not change and once fresness flag is
       // clear it should not be set until the next SEND packet arrives. But it
       // is logically possible.
-      if( 0==casio_serial->availableForWrite() ) return;
-      casio_serial->write(CASIO_ACK);
-      cccp_state=CCCP_GETHEADER0;
+      if( 0==cccp->serial->availableForWrite() ) return;
+      cccp_write(CASIO_ACK);
+      CCCP_STAT(sends);
+      cccp->state=CCCP_GETHEADER0;
       // Expect to get :END packet which leads to IDLE, but if there is some
       // other valid :VAL or :REQ packet, it might as well be acted upon.
       break;
 
     case CCCP_RECEIVE_WAITDATA:
       // wait for the data to become ready, client may be on hold
-      if( NULL!=cccp_actionbox
-      && !cccp_actionbox->immediate
-      && !cccp_actionbox->fresh )
+      if( NULL!=cccp->actionbox
+      && !cccp->actionbox->immediate
+      && !cccp->actionbox->fresh
+      && !cccp_hold_expired(cccp->actionbox->timeout) )
+        return; // serve a stale value once the hold has expired
+#ifdef CASIO_ARRAYS
+      if( NULL!=cccp->array_fresh
+      && !cccp->array_immediate
+      && !*cccp->array_fresh
+      && !cccp_hold_expired(cccp->array_timeout) )
         return;
-      cccp_state=CCCP_RECEIVE_ACK1;
+#endif
+      cccp->state=CCCP_RECEIVE_ACK1;
     case CCCP_RECEIVE_ACK1:
-      if( 0==casio_serial->availableForWrite() ) return;
-      casio_serial->write(CASIO_ACK);
-      cccp_state=CCCP_RECEIVE_CLIENTWAIT1;
+      if( 0==cccp->serial->availableForWrite() ) return;
+      cccp_write(CASIO_ACK);
+      cccp->state=CCCP_RECEIVE_CLIENTWAIT1;
     case CCCP_RECEIVE_CLIENTWAIT1:
-      if( 0==casio_serial->available() ) return;
-      if( casio_serial->read()!=CASIO_ACK ) {
-        cccp_state=CCCP_IDLE;
+      if( 0==cccp->serial->available() ) return;
+      if( cccp_read()!=CASIO_ACK ) {
+        cccp->state=CCCP_IDLE;
         break;
       }
       
     case CCCP_RECEIVE_VAL0:
       // populate :VAL buffer
-      cccp_buffer_size=CASIO_B_SIZE;
-      memcpy_P(cccp_buffer,PACKET_END,CASIO_B_SIZE);
-      memcpy_P(cccp_buffer,HEADER_VAL,5);
-      memcpy_P(cccp_buffer+CASIO_B_RANK,TAG_VM,2);
-      cccp_buffer[7]=0;
-      cccp_buffer[CASIO_B_USED1]=1;
-      cccp_buffer[9]=0;
-      cccp_buffer[CASIO_B_USED2]=1;
-      cccp_buffer[CASIO_B_NAME]=cccp_varname;
-      memcpy_P(cccp_buffer+CASIO_B_VARTAG,TAG_Variable,8);
-      cccp_buffer[CASIO_B_COMPLEX]='R';
-      cccp_buffer[CASIO_B_COMPLEX+1]=0x0a;
-      cccp_buffer[CASIO_B_CHECKSUM]=casio_checksum(cccp_buffer,cccp_buffer_size-1);
-
-      cccp_state=CCCP_RECEIVE_VAL;
-      cccp_buffer_index=0;
-#ifdef CASIO_DEBUG_V
-      Serial.print("ready to transmit :VAL for ");
-      Serial.println(cccp_varname);
-      serial_dump(cccp_buffer,cccp_buffer_size); 
+      cccp->buffer_size=CASIO_B_SIZE;
+      memcpy_P(cccp->buffer,PACKET_VAL,CASIO_B_SIZE);
+      cccp->tx_flash=NULL;
+#ifdef CASIO_COMPLEX
+      // decide once for :VAL and :0101, the box may change in between
+      cccp->complex=NULL!=cccp->actionbox && 0!=cccp->actionbox->im;
+      if( cccp->complex ) {
+        cccp->buffer[CASIO_B_COMPLEX]='C';
+        cccp->buffer[CASIO_B_CHECKSUM]-='C'-'R';
+      }
+#endif
+#ifdef CASIO_ARRAYS
+      if( CASIO_VM!=cccp->rank ) {
+        cccp_array_header(cccp->buffer);
+      } else
 #endif
+      {
+        cccp->elements=1;
+        cccp->element=0;
+        cccp->buffer[CASIO_B_NAME]=cccp->varname;
+        cccp->buffer[CASIO_B_CHECKSUM]-=cccp->varname;
+      }
+
+      cccp->state=CCCP_RECEIVE_VAL;
+      cccp->buffer_index=0;
+      CCCP_LOG(DEBUG, REPLY, cccp->varname, cccp->buffer, cccp->buffer_size);
     case CCCP_RECEIVE_VAL:
       // transmit :VAL buffer
-      if( 0==casio_serial->availableForWrite() ) return;
-      if( cccp_buffer_index<cccp_buffer_size ) {
-        casio_serial->write(cccp_buffer[cccp_buffer_index++]);
+      if( cccp->buffer_index<cccp->buffer_size ) {
+        if( !cccp_transmit_bytes() ) return;
         break;
       }
-      cccp_state=CCCP_RECEIVE_CLIENTWAIT2;
+      cccp->state=CCCP_RECEIVE_CLIENTWAIT2;
     case CCCP_RECEIVE_CLIENTWAIT2:
-      if( 0==casio_serial->available() ) return;
-      rd=casio_serial->read();
+      if( 0==cccp->serial->available() ) return;
+      rd=cccp_read();
       if( rd==CASIO_RETRY ) {
+        CCCP_STAT(retries);
         // resend already populated buffer
-        cccp_buffer_index=0;
-        cccp_state=CCCP_RECEIVE_VAL;
+        cccp->buffer_index=0;
+        cccp->state=CCCP_RECEIVE_VAL;
         break;
       } else if( rd!=CASIO_ACK ) {
-        cccp_state=CCCP_IDLE;
+        cccp->state=CCCP_IDLE;
         break;
       }
     case CCCP_RECEIVE_0101_0:
-      cccp_buffer_size=CASIO_R_SIZE; // TODO: ...or _C_SIZE
-      memset(cccp_buffer,0,cccp_buffer_size);
-      memcpy_P(cccp_buffer,HEADER_0101,5);
+      if( cccp->element>=cccp->elements ) {
+        // empty list
+        cccp->state=CCCP_RECEIVE_END0;
+        break;
+      }
+      cccp->buffer_size=CASIO_R_SIZE;
+      memset(cccp->buffer,0,CASIO_C_SIZE);
+      memcpy_P(cccp->buffer,HEADER_0101,5);
+      cccp->tx_flash=NULL;
+#ifdef CASIO_ARRAYS
+      if( CASIO_VM!=cccp->rank ) {
+        casio_number_format(&cccp->buffer[CASIO_B_RE],cccp_array_element(cccp->buffer));
+      } else
+#endif
+#ifdef CASIO_GROUPS
+      if( NULL!=cccp->groupbox ) {
+        casio_number_format(&cccp->buffer[CASIO_B_RE], cccp_group_value());
+      } else
+#endif
       // TODO? send back "unused" response instead of a default value
-      casio_number_format(&cccp_buffer[CASIO_B_RE]
-       ,cccp_actionbox==NULL?CASIO_DEFAULT_VALUE:cccp_actionbox->value);
-      cccp_buffer[cccp_buffer_size-1]=casio_checksum(cccp_buffer,cccp_buffer_size-1);
-      cccp_buffer_index=0;
-      cccp_state=CCCP_RECEIVE_0101;
+      casio_number_format(&cccp->buffer[CASIO_B_RE]
+       ,cccp->actionbox==NULL?CASIO_DEFAULT_VALUE:casio_from_value(cccp->actionbox->value));
+#ifdef CASIO_COMPLEX
+      if( cccp->complex ) {
+        cccp->buffer_size=CASIO_C_SIZE;
+        // sign byte of the real part tells that imaginary part follows
+        cccp->buffer[CASIO_B_RE+8]|=CASIO_IM;
+        casio_number_format(&cccp->buffer[CASIO_B_IM],
+          NULL==cccp->actionbox?0.0:casio_from_value(cccp->actionbox->im));
+      }
+#endif
+      cccp->buffer[cccp->buffer_size-1]=casio_checksum(cccp->buffer,cccp->buffer_size-1);
+      cccp->buffer_index=0;
+      cccp->state=CCCP_RECEIVE_0101;
     case CCCP_RECEIVE_0101:
       // transmit 0101 buffer
-      if( 0==casio_serial->availableForWrite() ) return;
-      if( cccp_buffer_index<cccp_buffer_size ) {
-        casio_serial->write(cccp_buffer[cccp_buffer_index++]);
+      if( cccp->buffer_index<cccp->buffer_size ) {
+        if( !cccp_transmit_bytes() ) return;
         break;
       }
-      cccp_state=CCCP_RECEIVE_CLIENTWAIT3;
+      cccp->state=CCCP_RECEIVE_CLIENTWAIT3;
 
     case CCCP_RECEIVE_CLIENTWAIT3:
-      if( 0==casio_serial->available() ) return;
-      rd=casio_serial->read();
+      if( 0==cccp->serial->available() ) return;
+      rd=cccp_read();
       if( rd==CASIO_RETRY ) {
+         CCCP_STAT(retries);
          // TODO? repopulate buffer with fresher data
-         cccp_buffer_index=0;
-         cccp_state=CCCP_RECEIVE_0101;
+         cccp->buffer_index=0;
+         cccp->state=CCCP_RECEIVE_0101;
          break;
       } else if( rd!=CASIO_ACK ) {
-        cccp_state=CCCP_IDLE;
+        cccp->state=CCCP_IDLE;
         break;
       }
+      if( ++cccp->element<cccp->elements ) {
+        // next element of a list
+        cccp->state=CCCP_RECEIVE_0101_0;
+        break;
+      }
+      CCCP_STAT(receives);
       // only clear freshness if received confirmation
-      if( cccp_actionbox!=NULL ) cccp_actionbox->fresh=false;
+      if( cccp->actionbox!=NULL ) cccp->actionbox->fresh=false;
+#ifdef CASIO_GROUPS
+      if( NULL!=cccp->groupbox ) cccp_group_served();
+#endif
+#ifdef CASIO_ARRAYS
+      if( cccp->array_fresh!=NULL ) *cccp->array_fresh=false;
+#endif
     
     case CCCP_RECEIVE_END0:
-      // populate :END buffer
-      cccp_state=CCCP_RECEIVE_END;
-      cccp_buffer_size=CASIO_B_SIZE;
-      memcpy_P(cccp_buffer, PACKET_END, CASIO_B_SIZE);
-      cccp_buffer_index=0;
+      // :END is transmitted from program memory
+      cccp->state=CCCP_RECEIVE_END;
+      cccp->buffer_size=CASIO_B_SIZE;
+      cccp->tx_flash=PACKET_END;
+      cccp->buffer_index=0;
     case CCCP_RECEIVE_END:
-      // transmit :END buffer
-      if( 0==casio_serial->availableForWrite() ) return;
-      if( cccp_buffer_index<cccp_buffer_size ) {
-        casio_serial->write(cccp_buffer[cccp_buffer_index++]);
+      // transmit :END
+      if( cccp->buffer_index<cccp->buffer_size ) {
+        if( !cccp_transmit_bytes() ) return;
         break;
       }
-      cccp_state=CCCP_IDLE;
+      cccp->state=CCCP_IDLE;
       break;
       // send value requested value
+    case CCCP_RESEND:
+      // the packet was garbled, have the calculator send it again
+      if( 0==cccp->serial->availableForWrite() ) return;
+      cccp_write(CASIO_RETRY);
+      CCCP_STAT(resends);
+      cccp->state=cccp->resend_state;
+      break;
+
     case CCCP_NACK:
-      if( 0==casio_serial->availableForWrite() ) return;
-#ifdef CASIO_DEBUG
-      Serial.println("Sending NACK");
-#endif
-      casio_serial->write(CASIO_ERROR);
-      cccp_state=CCCP_IDLE;
+      if( 0==cccp->serial->availableForWrite() ) return;
+      CCCP_LOG(ERROR, NACK, 0, NULL, 0);
+      cccp_write(CASIO_ERROR);
+      CCCP_STAT(nacks);
+      cccp->state=CCCP_IDLE;
       break;
       
     default:
-      cccp_state=CCCP_IDLE;
+      cccp->state=CCCP_IDLE;
   }
 }
 
@@ -28,8 +28,23 @@
  * It can be &Serial on arduinos without extra serial interfaces, but extreme
  * care should be taken to ensure that nothing else, especially debug messages
  * are transmitted over it.
+ * casio_poll() only uses the Stream interface (available(), read(),
+ * availableForWrite(), write()), so anything derived from Stream can serve as
+ * a transport, e.g. the in-memory loopback of the host build in extras/host.
+ * The transport must report free space in availableForWrite().
  */
-extern HardwareSerial *casio_serial;
+extern Stream *casio_serial;
+
+// Rate to open the port at. SEND()/RECEIVE() run at 9600 baud; calculators
+// with Send38k()/Receive38k() (fx-9860G and later) send the same packets at
+// 38400 when the program uses those instead. Nothing in casio_poll() depends
+// on the rate, but a 50-byte header takes 13 ms to arrive at 38400, so the
+// port's receive buffer must not overflow between calls.
+#ifndef CASIO_BAUD
+#define CASIO_BAUD 9600
+#endif
+static_assert(CASIO_BAUD==9600 || CASIO_BAUD==38400,
+  "CASIO_BAUD must be 9600 or 38400, the rates calculators use");
 
 // variable names are
 // 'A'..'Z'
@@ -39,8 +54,163 @@ extern HardwareSerial *casio_serial;
 #define CASIO_LOWR 0xcd
 #define CASIO_THETA 0xce
 
+/* Feature switches. Those on by default are turned off by defining
+ * CASIO_NO_<switch> for the build, e.g. -DCASIO_NO_MATRICES, and the others
+ * turned on by defining them; numbers may be set the same way. Editing this
+ * file works too.
+ */
 
+// Mailboxes are arrays of the sketch, linked by fill_static_links().
+#ifndef CASIO_NO_STATIC_MAILBOX
 #define CASIO_STATIC_MAILBOX
+#endif
+
+// Without CASIO_STATIC_MAILBOX a mailbox is created for every new name a
+// calculator sends or asks for. Boxes come from a pool of this many, shared by
+// the inboxes and outboxes of all sessions, not from the heap.
+#ifndef CASIO_POOL_SIZE
+#define CASIO_POOL_SIZE 28
+#endif
+
+// Keep direct-indexed tables of mailboxes, one slot per variable name, so
+// that finding a mailbox for an incoming request does not walk the lists.
+#ifndef CASIO_NO_LOOKUP_TABLE
+#define CASIO_LOOKUP_TABLE
+#endif
+
+// Move packets to and from the serial port in blocks of whatever the port
+// can take at the moment rather than one byte per casio_poll() iteration.
+#ifndef CASIO_NO_BLOCK_IO
+#define CASIO_BLOCK_IO
+#endif
+
+// Milliseconds the calculator may stay silent in the middle of a transaction
+// before it is abandoned and the link goes back to waiting for $15. Bytes
+// already in the port's buffer are read first, however late casio_poll() is.
+#ifndef CASIO_TIMEOUT
+#define CASIO_TIMEOUT 1000
+#endif
+
+// Times a packet with a bad checksum is asked for again before the request is
+// rejected.
+#ifndef CASIO_RETRIES
+#define CASIO_RETRIES 3
+#endif
+
+// Mailboxes carry an imaginary part and exchange complex values.
+#ifndef CASIO_NO_COMPLEX
+#define CASIO_COMPLEX
+#endif
+
+// Exchange lists (SEND(List n)/RECEIVE(List n)) through list mailboxes.
+#ifndef CASIO_NO_LISTS
+#define CASIO_LISTS
+#endif
+
+// Exchange matrices (SEND(Mat X)/RECEIVE(Mat X)) through element callbacks.
+#ifndef CASIO_NO_MATRICES
+#define CASIO_MATRICES
+#endif
+
+// Inboxes may queue values in a ring buffer instead of keeping only the last.
+#ifndef CASIO_NO_QUEUES
+#define CASIO_QUEUES
+#endif
+
+// Outboxes may be grouped to serve several variables from one snapshot.
+#ifndef CASIO_NO_GROUPS
+#define CASIO_GROUPS
+#endif
+
+// Count transactions, errors, bytes and time spent in protocol states.
+// casio_stats takes 592 bytes of RAM on AVR (1184 on 64-bit hosts), each
+// session 10 more on AVR, and each casio_poll() a micros() call.
+// #define CASIO_STATS
+
+// Smaller RAM footprint for boards like the Uno: mailbox flags packed in
+// bits, 16-bit millisecond timers (timeouts up to 65535 ms) and no stand-in
+// mailbox for unknown names, which are answered with a default value instead.
+// #define CASIO_COMPACT
+
+// Type of mailbox values and imaginary parts. float halves them where double
+// is 8 bytes (ARM, ESP32; on AVR double is float already). An integer type
+// stores values times CASIO_VALUE_SCALE (1 unless set), rounded, e.g.
+// int16_t and 100 for -327.68..327.67 in steps of 0.01; values beyond are
+// stored as the nearest end of the range. POST_TO_BOX() scales, reads of
+// .value must divide. Either may be set without the other.
+#ifndef CASIO_VALUE_TYPE
+#define CASIO_VALUE_TYPE double
+#endif
+#ifndef CASIO_VALUE_SCALE
+#define CASIO_VALUE_SCALE 1
+#endif
+
+// Report protocol events to casio_log_sink: 0 nothing, no code compiled in;
+// 1 errors (rejected packets, errors sent, timeouts); 2 also warnings (unknown
+// names, packets asked for again, expired holds); 3 also every packet.
+#ifndef CASIO_LOG_LEVEL
+#define CASIO_LOG_LEVEL 0
+#endif
+
+// Keep up to this many events from casio_poll() and format them in
+// casio_log_flush() instead, so logging costs casio_poll() a copy of a few
+// bytes and never waits for the sink.
+// #define CASIO_LOG_BUFFER 8
+
+#ifdef CASIO_QUEUES
+/* Ring buffer of values sent to an inbox. casio_poll() only adds values and
+ * the firmware only takes them, each side moving its own index, so neither
+ * needs to disable interrupts. Holds size-1 values.
+ */
+typedef struct {
+  double *data;
+#ifdef CASIO_COMPLEX
+  double *im; // imaginary parts, NULL to drop them
+#endif
+  byte size; // slots in .data, up to 255
+  byte head; // next slot to fill, moved by casio_poll()
+  byte tail; // next slot to take, moved by the firmware
+  unsigned int dropped; // values lost to a full queue
+} CasioQueue;
+
+// Statically allocated queue over an array
+#define INQUEUE(array) {data:array, size:sizeof(array)/sizeof(array[0])}
+
+// Take the oldest value off a queue; false if it is empty
+bool casio_queue_get(CasioQueue *queue, double *value, double *im=NULL);
+// Number of values waiting
+int casio_queue_count(CasioQueue *queue);
+#endif
+
+typedef CASIO_VALUE_TYPE CasioValue;
+
+#ifdef CASIO_COMPACT
+typedef uint16_t CasioMillis; // wraps after 65 s, enough for differences
+#else
+typedef unsigned long CasioMillis;
+#endif
+
+// value as stored in a mailbox and back
+inline CasioValue casio_to_value(double v)
+{
+  if( (CasioValue)0.5!=0 ) return (CasioValue)(v*CASIO_VALUE_SCALE);
+  // integer type: round, saturate, NaN is 0
+  const bool is_signed=(CasioValue)-1<0;
+  const int bits=8*sizeof(CasioValue)-(is_signed?1:0);
+  const CasioValue max=(CasioValue)(~(uint64_t)0>>(64-bits));
+  const double lim=ldexp(1.0, bits); // first value above max
+  double s=v*CASIO_VALUE_SCALE;
+  if( s!=s ) return 0;
+  if( !(s<lim-0.5) ) return max;
+  if( is_signed && !(s>-lim-0.5) ) return (CasioValue)(-max-1);
+  if( !is_signed && s<0 ) return 0;
+  return (CasioValue)(s+(s<0?-0.5:0.5));
+}
+
+inline double casio_from_value(CasioValue v)
+{
+  return (double)v/CASIO_VALUE_SCALE;
+}
 
 typedef struct casiomailbox {
   char name;
@@ -48,33 +218,115 @@ typedef struct casiomailbox {
   // inbox: indicates new data from calc; expected to be cleared after firmware
   //   acts upon it
   // outbox: set by firmware whenever it updates it
+#ifdef CASIO_COMPACT
+  bool fresh:1;
+  bool immediate:1;
+#else
   bool fresh;
   bool immediate; // ignore freshness, use the data as is and immediately
-  double value;
+#endif
+  // non-immediate box: longest hold of the calculator in ms, then the value
+  // is served stale or the SEND() is released anyway; 0 waits forever
+  unsigned int timeout;
+  CasioValue value;
+#ifdef CASIO_COMPLEX
+  // imaginary part; outbox with non-zero .im is sent as a complex value
+  CasioValue im;
+#endif
+  // outbox: called when a RECEIVE() asks for the box, with .fresh cleared, to
+  // post a value now or, for a non-immediate box, later through the box
+  // pointer it is given
+  void (*produce)(struct casiomailbox *box);
+#ifdef CASIO_QUEUES
+  // inbox: values go to this queue rather than .value; while it is full the
+  // calculator is held, for .timeout ms if set, then the value is dropped
+  CasioQueue *queue;
+#endif
   struct casiomailbox *next; // linked list
 #ifndef CASIO_STATIC_MAILBOX
+  // the pointer to this box in its list, kept by the library so that
+  // casio_free_mailbox() unlinks it without a walk
+  struct casiomailbox **link;
 #endif
 } CasioMailBox;
 
 // Use these macros to allocate memory statically for mailboxes.
 #ifdef CASIO_STATIC_MAILBOX
-#define IMMEDIATE(n) {name:n, fresh:false, immediate:true, value:0.0}
-#define MAILBOX(n,imm) {name:n, fresh:false, immediate:imm, value:0.0}
+#define IMMEDIATE(n) {name:n, fresh:false, immediate:true, value:0}
+#define MAILBOX(n,imm) {name:n, fresh:false, immediate:imm, value:0}
+#define TIMEDBOX(n,ms) {name:n, fresh:false, immediate:false, timeout:ms, value:0}
+#define PRODUCER(n,imm,fn) {name:n, fresh:false, immediate:imm, value:0, produce:fn}
+#ifdef CASIO_QUEUES
+#define QUEUEDBOX(n,q) {name:n, fresh:false, immediate:true, value:0, queue:&q}
+#endif
 #endif
 
 // use the POST_TO_BOX macro to post directly or to define 
 // post macros for specific mailboxes, e.g.
 // #define BOX_LEFT(v) POST_TO_BOX(my_outbox[0],v)
 
-#define POST_TO_BOX(BOX,V) do{BOX.value=V;BOX.fresh=true;}while(0)
+#ifdef CASIO_COMPLEX
+#define POST_TO_BOX(BOX,V) do{(BOX).value=casio_to_value(V);(BOX).im=0;(BOX).fresh=true;}while(0)
+#define POST_COMPLEX_TO_BOX(BOX,RE,IM) do{(BOX).value=casio_to_value(RE);(BOX).im=casio_to_value(IM);(BOX).fresh=true;}while(0)
+#else
+#define POST_TO_BOX(BOX,V) do{(BOX).value=casio_to_value(V);(BOX).fresh=true;}while(0)
+#endif
 
 extern CasioMailBox *casio_inboxes;
 extern CasioMailBox *casio_outboxes;
 
 CasioMailBox *get_mailbox(CasioMailBox **head, char name, bool create_if_not_exists=false);
 
-inline CasioMailBox *get_outbox(char name) { return get_mailbox(&casio_outboxes, name); }
-inline CasioMailBox *get_inbox(char name) { return get_mailbox(&casio_inboxes, name); }
+#ifndef CASIO_STATIC_MAILBOX
+typedef struct {
+  byte used; // boxes taken from the pool
+  byte peak; // most ever taken at once
+  unsigned int exhausted; // names that found the pool empty
+} CasioPoolStats;
+
+extern CasioPoolStats casio_pool;
+
+// Unlink the mailbox of a name from a list and return it to the pool. A
+// transaction using the box goes on without it. False if there is none.
+// O(1) for casio_inboxes and casio_outboxes with CASIO_LOOKUP_TABLE; other
+// lists are searched for the name.
+bool casio_free_mailbox(CasioMailBox **head, char name);
+#endif
+
+// There are only 28 variable names: 'A'..'Z', r and θ. Each has a slot.
+#define CASIO_NAMES 28
+
+// slot of a variable name, -1 if it is not a valid name
+inline int casio_name_index(char name)
+{
+  if( name>='A' && name<='Z' ) return name-'A';
+  if( (byte)name==CASIO_LOWR ) return 26;
+  if( (byte)name==CASIO_THETA ) return 27;
+  return -1;
+}
+
+// variable name of a slot
+inline char casio_index_name(int index)
+{
+  if( index<26 ) return 'A'+index;
+  return index==26?(char)CASIO_LOWR:(char)CASIO_THETA;
+}
+
+#ifdef CASIO_LOOKUP_TABLE
+
+CasioMailBox *get_outbox(char name, bool create_if_not_exists=false);
+CasioMailBox *get_inbox(char name, bool create_if_not_exists=false);
+
+// Tables are rebuilt automatically when casio_inboxes or casio_outboxes is
+// assigned. If mailboxes are added to or removed from a list without
+// changing its head, call this function to rebuild them.
+void casio_index_mailboxes();
+#else
+inline CasioMailBox *get_outbox(char name, bool create_if_not_exists=false)
+{ return get_mailbox(&casio_outboxes, name, create_if_not_exists); }
+inline CasioMailBox *get_inbox(char name, bool create_if_not_exists=false)
+{ return get_mailbox(&casio_inboxes, name, create_if_not_exists); }
+#endif
 
 // get_mailbox relies on linked list fields to find appropriate box.
 // If mailboxes are allocated in static arrays, their link fields need to be
@@ -83,17 +335,446 @@ inline CasioMailBox *get_inbox(char name) { return get_mailbox(&casio_inboxes, n
 //  fill_static_links(&my_outbox[0], sizeof(my_outbox));
 void fill_static_links(CasioMailBox *head, int count);
 
+// 'A'..'Z', r or θ
+constexpr bool casio_valid_name(char name)
+{
+  return (name>='A' && name<='Z') || (byte)name==CASIO_LOWR || (byte)name==CASIO_THETA;
+}
+
+#ifdef CASIO_STATIC_MAILBOX
+/* Compile-time mailbox registry. The boxes of a list are given as types:
+ *
+ *   CasioMailBoxes<
+ *     CasioBox<'W'>,                 // holds the calculator
+ *     CasioBox<'L',true>,            // immediate
+ *     CasioBox<'H',false,500>,       // holds for at most 500 ms
+ *     CasioProducer<'T',true,produce_millis>,
+ *     CasioQueued<'X',sample_queue>  // CasioQueue with static storage
+ *   > my_inbox;
+ *
+ *   casio_inboxes=my_inbox.head();
+ *   if( my_inbox.box<'L'>().fresh ) ...
+ *
+ * The boxes are linked by the compiler, so no fill_static_links() is needed
+ * and there is no count to get wrong. Names outside 'A'..'Z', r, θ and names
+ * used twice in a list fail to compile, as does box<>() of a name that is not
+ * in the list. box<>() is the address of an array element, no lookup.
+ */
+template<char N, bool IMM=false, unsigned int TIMEOUT=0>
+struct CasioBox {
+  static const char name=N;
+  static constexpr CasioMailBox make(CasioMailBox *next)
+  {
+    return {name:N, fresh:false, immediate:IMM, timeout:TIMEOUT, value:0,
+      next:next};
+  }
+};
+
+template<char N, bool IMM, void (*FN)(CasioMailBox *)>
+struct CasioProducer {
+  static const char name=N;
+  static constexpr CasioMailBox make(CasioMailBox *next)
+  {
+    return {name:N, fresh:false, immediate:IMM, timeout:0, value:0,
+      produce:FN, next:next};
+  }
+};
+
+#ifdef CASIO_QUEUES
+template<char N, CasioQueue &Q>
+struct CasioQueued {
+  static const char name=N;
+  static constexpr CasioMailBox make(CasioMailBox *next)
+  {
+    return {name:N, fresh:false, immediate:true, timeout:0, value:0,
+      queue:&Q, next:next};
+  }
+};
+#endif
+
+constexpr bool casio_valid_names() { return true; }
+template<class... T>
+constexpr bool casio_valid_names(char first, T... rest)
+{
+  return casio_valid_name(first) && casio_valid_names(rest...);
+}
+
+constexpr bool casio_name_in(char) { return false; }
+template<class... T>
+constexpr bool casio_name_in(char name, char first, T... rest)
+{
+  return name==first || casio_name_in(name, rest...);
+}
+
+constexpr bool casio_unique_names() { return true; }
+template<class... T>
+constexpr bool casio_unique_names(char first, T... rest)
+{
+  return !casio_name_in(first, rest...) && casio_unique_names(rest...);
+}
+
+constexpr int casio_name_position(char) { return 0; }
+template<class... T>
+constexpr int casio_name_position(char name, char first, T... rest)
+{
+  return name==first?0:1+casio_name_position(name, rest...);
+}
+
+template<int... I> struct CasioIndices {};
+template<int N, int... I>
+struct CasioMakeIndices : CasioMakeIndices<N-1, N-1, I...> {};
+template<int... I>
+struct CasioMakeIndices<0, I...> { typedef CasioIndices<I...> type; };
+
+template<class... B>
+struct CasioMailBoxes {
+  static const int count=sizeof...(B);
+  static_assert(count>0, "empty mailbox list");
+  static_assert(casio_valid_names(B::name...),
+    "mailbox name must be 'A'..'Z', r or theta");
+  static_assert(casio_unique_names(B::name...), "duplicate mailbox name");
+
+  CasioMailBox boxes[count];
+
+  constexpr CasioMailBoxes() : CasioMailBoxes(typename CasioMakeIndices<count>::type()) {}
+
+  CasioMailBox *head() { return &boxes[0]; }
+
+  template<char N>
+  CasioMailBox &box()
+  {
+    static_assert(casio_name_in(N, B::name...), "no mailbox of this name");
+    return boxes[casio_name_position(N, B::name...)];
+  }
+
+private:
+  template<int... I>
+  constexpr CasioMailBoxes(CasioIndices<I...>)
+    : boxes{ B::make(I+1<count?boxes+I+1:NULL)... } {}
+};
+#endif
+
 // This procedure implements serial protocols for SEND() and RECEIVE()
 // operators. It populates inboxes with the incoming values and uses values in
 // outboxes to respond to variable requests.
-// It should be called periodically, e.g. in the loop()
+// It should be called periodically, e.g. in the loop(), or on events: from a
+// timer interrupt, when bytes arrive or when the port can take more. A call
+// made while another one is still running, e.g. from an interrupt during a
+// call from loop(), is not nested but makes the running call go once more.
 void casio_poll();
 
+// True when no transaction is in progress and no bytes are waiting, i.e. it
+// is safe to sleep until the next interrupt.
+bool casio_idle();
+
 // This hook is called each time casio_poll gets a RECEIVE() request from a
 // calculator. It gets the name of the requested variable as its first
 // parameter.
 extern void (*casio_receive_hook)(char);
 
+#ifdef CASIO_LISTS
+/* List mailboxes hold "List n" variables. Elements are streamed one packet
+ * at a time between the serial port and the user array .data, so a list of
+ * any length needs no extra buffering.
+ *
+ * Incoming list is written to .data as it arrives; elements past .capacity
+ * are acknowledged and dropped. When the whole list is in, .size is set to the
+ * number of stored elements and .fresh goes on. Only real parts of complex
+ * lists are kept.
+ *
+ * RECEIVE(List n) sends .size elements of .data. Flags work as for ordinary
+ * mailboxes.
+ */
+typedef struct casiolistbox {
+  byte number; // List n, 1..26
+  bool fresh;
+  bool immediate;
+  unsigned int timeout; // as in CasioMailBox
+  int size; // elements in .data
+  int capacity; // elements .data can hold
+  double *data;
+  struct casiolistbox *next; // linked list
+} CasioListBox;
+
+// Statically allocated list mailbox over an array
+#define LISTBOX(n,imm,array) {number:n, fresh:false, immediate:imm, size:0, \
+  capacity:sizeof(array)/sizeof(array[0]), data:array}
+
+extern CasioListBox *casio_list_inboxes;
+extern CasioListBox *casio_list_outboxes;
+
+CasioListBox *get_listbox(CasioListBox *head, byte number);
+void fill_static_links(CasioListBox *head, int count);
+#endif
+
+#ifdef CASIO_MATRICES
+/* Matrix mailboxes hold "Mat X" variables. The library never holds a whole
+ * matrix: elements are handed to .put as they arrive and are obtained from
+ * .get as they are sent, one at a time. Rows and columns are counted from 1.
+ *
+ * On SEND(Mat X) .rows and .cols are set from the header before the first
+ * element arrives; .fresh goes on after the last one.
+ * On RECEIVE(Mat X) a .rows by .cols matrix is sent, row by row.
+ * Flags work as for ordinary mailboxes.
+ */
+typedef struct casiomatrixbox {
+  char name; // 'A'..'Z' of Mat X
+  bool fresh;
+  bool immediate;
+  unsigned int timeout; // as in CasioMailBox
+  int rows;
+  int cols;
+  // store an element of an incoming matrix
+  void (*put)(struct casiomatrixbox *box, int row, int col, double value);
+  // provide an element of a matrix being sent
+  double (*get)(struct casiomatrixbox *box, int row, int col);
+  struct casiomatrixbox *next; // linked list
+} CasioMatrixBox;
+
+#define MATRIXBOX(n,imm,put_fn,get_fn) {name:n, fresh:false, immediate:imm, \
+  rows:0, cols:0, put:put_fn, get:get_fn}
+
+extern CasioMatrixBox *casio_matrix_inboxes;
+extern CasioMatrixBox *casio_matrix_outboxes;
+
+CasioMatrixBox *get_matrixbox(CasioMatrixBox *head, char name);
+void fill_static_links(CasioMatrixBox *head, int count);
+#endif
+
+#ifdef CASIO_GROUPS
+/* Outbox groups serve variables that belong together, e.g. the axes of a
+ * sensor read by RECEIVE(X):RECEIVE(Y):RECEIVE(Z), from one sample. The
+ * firmware fills a sample with casio_group_set() and makes it current with
+ * casio_group_publish(). The first RECEIVE() of a member latches the current
+ * sample and the other members are served from it, until each member has
+ * been read once, a member is read again or .timeout ms pass without a read.
+ * The next RECEIVE() latches a sample anew.
+ *
+ * A group keeps three samples: the one being filled, the current one and the
+ * one latched by the calculator, so publishing never waits for a RECEIVE()
+ * and nothing is copied. Members are real values, served as they are, like
+ * immediate outboxes; a group is meant to be read by one calculator.
+ * A member of a group hides an outbox of the same name.
+ */
+typedef struct casiogroupbox {
+  const char *names; // members in slot order, e.g. "XYZ", up to 8
+  byte count; // members
+  unsigned int timeout; // longest pause between reads of a latched sample
+  CasioValue *banks; // three samples of .count values each
+  byte state; // banks being filled, current and latched, 2 bits each
+  byte served; // members read from the latched sample, a bit each
+  CasioMillis latched_at; // last read of the latched sample
+  struct casiogroupbox *next; // linked list
+} CasioGroupBox;
+
+#define CASIO_GROUP_INIT 0x34 // filling 0, current 1, none latched
+
+// Statically allocated group over a CasioValue array[3][members]
+#define GROUPBOX(n,array) {names:n, \
+  count:sizeof(array[0])/sizeof(array[0][0]), timeout:CASIO_TIMEOUT, \
+  banks:&array[0][0], state:CASIO_GROUP_INIT}
+
+extern CasioGroupBox *casio_group_outboxes;
+
+// Set a member of the sample being filled, by slot
+inline void casio_group_set(CasioGroupBox *group, byte slot, double value)
+{
+  group->banks[(group->state&3)*group->count+slot]=casio_to_value(value);
+}
+
+// Make the sample filled so far current and start the next one. The new
+// sample holds an older one: set every member before publishing.
+void casio_group_publish(CasioGroupBox *group);
+
+// find the group with a member name and its slot, NULL if there is none
+CasioGroupBox *get_groupbox(CasioGroupBox *head, char name, byte *slot);
+void fill_static_links(CasioGroupBox *head, int count);
+#endif
+
+/* Protocol state of one serial port with one calculator on it.
+ * casio_poll() serves casio_serial through a built-in session, plus every
+ * session added with casio_add_session(), e.g. one per serial port of a Mega.
+ * A session may have mailboxes of its own; a NULL head means the shared
+ * ones (casio_inboxes, casio_list_inboxes etc.) are used.
+ * Fields after .next belong to the library.
+ */
+#define CASIO_BUFFER_SIZE 50 // largest packet, :VAL/:REQ/:END header
+
+typedef struct casiosession {
+  Stream *serial;
+  CasioMailBox *inboxes;
+  CasioMailBox *outboxes;
+#ifdef CASIO_LISTS
+  CasioListBox *list_inboxes;
+  CasioListBox *list_outboxes;
+#endif
+#ifdef CASIO_MATRICES
+  CasioMatrixBox *matrix_inboxes;
+  CasioMatrixBox *matrix_outboxes;
+#endif
+#ifdef CASIO_GROUPS
+  CasioGroupBox *group_outboxes;
+#endif
+  struct casiosession *next; // linked list
+
+  int state;
+  byte buffer[CASIO_BUFFER_SIZE];
+  int buffer_index;
+  int buffer_size;
+  const byte *tx_flash; // packet in program memory, NULL to send buffer
+  char varname; // requested name; needed if there is no mailbox for it
+  byte rank; // kind of variable requested
+  bool complex; // value being sent by RECEIVE() is complex
+  CasioMailBox *actionbox; // mailbox of the current request
+#ifdef CASIO_GROUPS
+  CasioGroupBox *groupbox; // or group and member of it
+  byte group_slot;
+  byte group_bank; // sample latched for the request
+#endif
+#ifdef CASIO_LISTS
+  CasioListBox *listbox;
+#endif
+#ifdef CASIO_MATRICES
+  CasioMatrixBox *matrixbox;
+#endif
+#if defined(CASIO_LISTS) || defined(CASIO_MATRICES)
+  bool *array_fresh; // flags of the list or matrix mailbox, NULL if none
+  bool array_immediate;
+  unsigned int array_timeout;
+#endif
+  int elements; // data packets in the current request
+  int element; // data packets done so far
+  int cols; // columns of the matrix being sent
+#ifdef CASIO_QUEUES
+  bool queued; // value in .buffer waits for room in the queue of the actionbox
+#endif
+  byte retries; // resends of the current packet asked for
+  int resend_state; // where to wait for the resent packet
+  CasioMillis last_change; // last state change or byte received, ms
+  int last_state;
+  bool progress; // bytes were received since last_change
+  uint32_t fresh_names; // inboxes given a value, see casio_take_fresh()
+#ifdef CASIO_STATS
+  int stat_state; // state as of the last poll and when it was entered
+  unsigned long stat_since;
+  unsigned long stat_start; // beginning of the transaction
+#endif
+} CasioSession;
+
+extern CasioSession *casio_sessions;
+
+// Reset a session on a port and put it on the casio_sessions list.
+// Set its mailbox heads afterwards if it should not use the shared ones.
+void casio_add_session(CasioSession *session, Stream *port);
+// Serve one session only; casio_poll() serves them all. Either one called
+// while the other runs (e.g. from an interrupt) makes the running one poll
+// all sessions again before it returns.
+void casio_poll_session(CasioSession *session);
+
+// Bit of a name in casio_take_fresh()
+#define CASIO_FRESH_BIT(name) ((uint32_t)1<<casio_name_index(name))
+
+// Names of the inboxes that were sent a value since the last call, a bit each
+// (CASIO_FRESH_BIT), and clear them at once, so one test tells if anything
+// came in. Covers the inboxes of all sessions unless one is given. The
+// .fresh flags of the boxes are left alone.
+uint32_t casio_take_fresh(CasioSession *session=NULL);
+// Take the lowest name out of bits and return its inbox, looked up in head or
+// the shared inboxes if NULL. NULL when no names are left.
+CasioMailBox *casio_next_fresh(uint32_t *bits, CasioMailBox *head=NULL);
+
+#ifdef CASIO_STATS
+// dwell time buckets: <8us, <64us, <512us, <4ms, <33ms, <262ms, <2s, longer
+#define CASIO_STAT_BUCKETS 8
+#define CASIO_STATES 22 // protocol states, see CCCP_STATE in CasioSerial.cpp
+
+typedef struct {
+  unsigned long visits;
+  unsigned long time; // total, microseconds
+  unsigned int hist[CASIO_STAT_BUCKETS];
+} CasioDwell;
+
+typedef struct {
+  unsigned long sends; // variables, lists and matrices taken from SEND()
+  unsigned long receives; // and given to RECEIVE()
+  unsigned long nacks; // errors reported to the calculator
+  unsigned long retries; // resend requests from the calculator
+  unsigned long resends; // and to the calculator
+  unsigned long checksum_errors; // rejected packets with a bad checksum
+  unsigned long timeouts; // transactions abandoned by a silent calculator
+  unsigned long expired; // holds released by a mailbox timeout
+  unsigned long bytes_in;
+  unsigned long bytes_out;
+  CasioDwell transaction; // from $15 back to idle
+  // time between entering and leaving each state, as seen by casio_poll();
+  // states passed through within one call have no visits
+  CasioDwell state[CASIO_STATES];
+} CasioStats;
+
+extern CasioStats casio_stats;
+void casio_stats_reset();
+// name of a state; the string is in program memory
+const char *casio_state_name(int state);
+#endif
+
+#if CASIO_LOG_LEVEL>0
+#define CASIO_LOG_ERROR 1
+#define CASIO_LOG_WARNING 2
+#define CASIO_LOG_DEBUG 3
+
+enum CASIO_LOG_EVENT {
+  CASIO_LOG_REJECT_HEADER, CASIO_LOG_REJECT_DATA, CASIO_LOG_NACK,
+  CASIO_LOG_TIMEOUT, CASIO_LOG_NO_MAILBOX, CASIO_LOG_RESEND,
+  CASIO_LOG_EXPIRED, CASIO_LOG_HEADER, CASIO_LOG_DATA, CASIO_LOG_REPLY
+};
+
+#define CASIO_LOG_BYTES 12 // leading bytes of a packet kept with an event
+
+typedef struct {
+  byte level;
+  byte event;
+  byte arg; // variable name or protocol state
+  byte size; // bytes in .data
+  byte data[CASIO_LOG_BYTES];
+} CasioLogEvent;
+
+// Gets each event as a line of text, without a line end. NULL drops events.
+// Unless CASIO_LOG_BUFFER is defined it is called from casio_poll() and must
+// not write to the calculator's port.
+extern void (*casio_log_sink)(byte level, const char *message);
+// Format an event as the sink gets it; returns message
+char *casio_log_format(const CasioLogEvent *event, char *message, int size);
+#ifdef CASIO_LOG_BUFFER
+// Pass buffered events to the sink; call from loop()
+void casio_log_flush();
+extern unsigned int casio_log_dropped; // events lost to a full buffer
+#endif
+#endif
+
+// Low level protocol helpers. casio_poll() uses them internally; they are
+// exported for tools that need to speak or decode the protocol themselves.
+byte casio_checksum(byte *buffer, int size);
+// Convert a number into 10-byte CASIO format and back
+byte *casio_number_format(byte *buffer, double value);
+double casio_number_parse(byte *buffer);
+
+// A :VAL, :REQ or :END header, decoded
+enum CASIO_HEADER_TYPE { CASIO_VAL, CASIO_REQ, CASIO_END };
+enum CASIO_RANK { CASIO_VM, CASIO_LT, CASIO_MT }; // variable, list, matrix
+typedef struct {
+  byte type;
+  byte rank;
+  char name; // variable or matrix letter, list number
+  int rows; // dimensions of the value that follows a :VAL
+  int cols;
+  bool complex;
+} CasioHeader;
+
+// Decode a 50-byte header. Returns false if it is not a header of a kind the
+// library knows, whether or not support for it is compiled in. The checksum
+// is not checked.
+bool casio_parse_header(byte *buffer, CasioHeader *header);
+
 /*
  * --Receive()     --Send()
  * Casio MCU       Casio MCU
@@ -0,0 +1,76 @@
+#include <Arduino.h>
+#include <avr/sleep.h>
+#include "CasioSerial.h"
+
+/*
+ * The protocol runs from a timer interrupt, so loop() may take as long as it
+ * likes without making the calculator wait, and the CPU sleeps between
+ * transactions.
+ */
+
+CasioMailBox my_inbox[]={
+  MAILBOX('L',true) // brightness of built-in LED (0..100)
+#define BOX_LED my_inbox[0]
+};
+
+CasioMailBox my_outbox[]={
+  IMMEDIATE('T') // millisecond timer
+#define BOX_MILLIS(v) POST_TO_BOX(my_outbox[0],v)
+};
+
+// Timer0 runs millis() with an overflow every 1.024 ms. A compare match
+// half way through gets a tick of the same rate without touching the timer.
+ISR(TIMER0_COMPA_vect)
+{
+  casio_poll();
+}
+
+void setup() {
+  Serial.begin(CASIO_BAUD);
+  casio_serial=&Serial;
+
+  fill_static_links(&my_inbox[0], sizeof(my_inbox)/sizeof(CasioMailBox));
+  fill_static_links(&my_outbox[0], sizeof(my_outbox)/sizeof(CasioMailBox));
+  casio_inboxes=&my_inbox[0];
+  casio_outboxes=&my_outbox[0];
+
+  pinMode(LED_BUILTIN,OUTPUT);
+
+  OCR0A=0x80;
+  TIMSK0|=_BV(OCIE0A);
+}
+
+void loop() {
+  double v;
+  bool fresh;
+
+  /* Mailboxes are now shared with an interrupt: read and write them with
+   * interrupts off, a double takes more than one instruction to copy.
+   */
+  noInterrupts();
+  BOX_MILLIS(millis());
+  fresh=BOX_LED.fresh;
+  v=BOX_LED.value;
+  BOX_LED.fresh=false;
+  interrupts();
+
+  /* Try on your calculator:
+   * 5→L
+   * SEND(L)
+   * -- Built-in LED should go dim
+   */
+  if( fresh ) {
+    analogWrite(LED_BUILTIN,constrain(map((int)v,0,100,0,255),0,255));
+  }
+
+  /* Slow work here does not delay the calculator */
+  delay(100);
+
+  /* Nothing to do until the next interrupt: the timer tick or a byte from the
+   * calculator wakes the CPU up.
+   */
+  if( casio_idle() ) {
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_mode();
+  }
+}
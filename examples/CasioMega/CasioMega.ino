@@ -30,8 +30,8 @@ void setup() {
 
   // Setup communication interface.
   // Arduino Mega's Serial3 is communicating over pins 14 and 15.
+  Serial3.begin(CASIO_BAUD);
   casio_serial=&Serial3;
-  casio_serial->begin(9600);
   Serial.println("Listening on Serial3" );
 
   // Setup mailboxes
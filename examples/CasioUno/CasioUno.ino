@@ -1,23 +1,29 @@
 #include <Arduino.h>
 #include "CasioSerial.h"
 
-CasioMailBox my_inbox[]={
-  MAILBOX('W',false) // request by a calc: number of milliseconds to delay
-#define BOX_WAIT my_inbox[0]
-  ,MAILBOX('L',true) // brightness of built-in LED (0..255)
-#define BOX_LED my_inbox[1] // sent index for subsequent read
-  ,MAILBOX('I',true) // select analog input to read with 'V'
-#define BOX_INDEX my_inbox[2] // sent index for subsequent read
-};
-
-CasioMailBox my_outbox[]={
-  IMMEDIATE('T') // millisecond timer
-#define BOX_MILLIS(v) POST_TO_BOX(my_outbox[0],v)
-  ,IMMEDIATE('U') // microsecond timer
-#define BOX_MICROS(v)  POST_TO_BOX(my_outbox[1],v)
-  ,IMMEDIATE('V') // sensor value read from analog input 'I'
-#define BOX_VALUE(v)    POST_TO_BOX(my_outbox[2],v)
-};
+CasioMailBoxes<
+  CasioBox<'W'>, // request by a calc: number of milliseconds to delay
+  CasioBox<'L',true>, // brightness of built-in LED (0..255)
+  CasioBox<'I',true> // select analog input to read with 'V'
+> my_inbox;
+#define BOX_WAIT my_inbox.box<'W'>()
+#define BOX_LED my_inbox.box<'L'>()
+#define BOX_INDEX my_inbox.box<'I'>() // sent index for subsequent read
+
+int analog_pin=0;
+
+// Outbox values are only made when a calculator asks for them
+void produce_millis(CasioMailBox *box) { POST_TO_BOX(*box,millis()); }
+void produce_micros(CasioMailBox *box) { POST_TO_BOX(*box,micros()); }
+void produce_value(CasioMailBox *box) {
+  if( analog_pin>0 ) POST_TO_BOX(*box,analogRead(analog_pin));
+}
+
+CasioMailBoxes<
+  CasioProducer<'T',true,produce_millis>, // millisecond timer
+  CasioProducer<'U',true,produce_micros>, // microsecond timer
+  CasioProducer<'V',true,produce_value> // sensor value read from analog input 'I'
+> my_outbox;
 
 void hook_example(char name) {
 }
@@ -26,14 +32,12 @@ void setup() {
   // No debug or monitoring via serial port -- port is occupied by Casio
 
   // Setup communication interface.
+  Serial.begin(CASIO_BAUD);
   casio_serial=&Serial;
-  casio_serial->begin(9600);
 
-  // Setup mailboxes
-  fill_static_links(&my_inbox[0], sizeof(my_inbox)/sizeof(CasioMailBox));
-  fill_static_links(&my_outbox[0], sizeof(my_outbox)/sizeof(CasioMailBox));
-  casio_inboxes=&my_inbox[0];
-  casio_outboxes=&my_outbox[0];
+  // Setup mailboxes, already linked by the compiler
+  casio_inboxes=my_inbox.head();
+  casio_outboxes=my_outbox.head();
   casio_receive_hook=&hook_example;
 
   // Other initializations
@@ -44,8 +48,6 @@ void setup() {
 bool wait_in_progress=false;
 long wait_started=0;
 
-int analog_pin=0;
-
 void loop() {
 
   casio_poll();
@@ -53,15 +55,10 @@ void loop() {
   /* Try on your calculator:
    * RECEIVE(T)
    * then inspect T -- should show current timer.
-   * Look for hook trace in serial monitor window.
-   */
-  BOX_MILLIS(millis());
-
-  /* Try on your calculator:
    * RECEIVE(U)
    * then inspect U -- should show current timer in microseconds.
+   * Both are read by produce_millis()/produce_micros() when requested.
    */
-  BOX_MICROS(micros());
 
   /* Try on your calculator:
    * 1->I:SEND(I)
@@ -78,11 +75,9 @@ void loop() {
    * RECEIVE(V):V
    * and note the value. Then change the potentiometer position and execute
    * RECEIVE(V):V
-   * once more. Note how the value has changed.
+   * once more. Note how the value has changed. The pin is only read when
+   * V is requested, see produce_value().
    */
-  if( analog_pin>0 ) {
-     BOX_VALUE(analogRead(analog_pin)); 
-  }
 
   /* Try on your calculator:
    * 3000->W
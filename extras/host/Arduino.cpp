@@ -0,0 +1,72 @@
+// (C) 2018 by nsg
+#include "Arduino.h"
+#include <time.h>
+
+HardwareSerial Serial;
+
+static struct timespec host_epoch;
+
+static unsigned long long host_clock_us()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if( 0==host_epoch.tv_sec && 0==host_epoch.tv_nsec ) host_epoch=now;
+  return (now.tv_sec-host_epoch.tv_sec)*1000000ULL
+    +(now.tv_nsec-host_epoch.tv_nsec)/1000;
+}
+
+unsigned long millis() { return (unsigned long)(host_clock_us()/1000); }
+unsigned long micros() { return (unsigned long)host_clock_us(); }
+
+// Same output as avr-libc: sign, one digit, point, prec digits, 'e', exponent
+// sign and at least 2 exponent digits. avr-libc limits prec to 7.
+char *dtostre(double val, char *s, unsigned char prec, unsigned char flags)
+{
+  char fmt[8];
+  char *f=fmt;
+  if( prec>7 ) prec=7;
+  *f++='%';
+  if( flags & DTOSTR_PLUS_SIGN ) *f++='+';
+  else if( flags & DTOSTR_ALWAYS_SIGN ) *f++=' ';
+  *f++='.';
+  *f++='*';
+  *f++=(flags & DTOSTR_UPPERCASE)?'E':'e';
+  *f=0;
+  sprintf(s, fmt, prec, val);
+  return s;
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+  size_t n=0;
+  while( size-- && write(*buffer++) ) ++n;
+  return n;
+}
+
+size_t Print::print(long v)
+{
+  char buf[24];
+  snprintf(buf, sizeof(buf), "%ld", v);
+  return print(buf);
+}
+
+size_t Print::print(unsigned long v)
+{
+  char buf[24];
+  snprintf(buf, sizeof(buf), "%lu", v);
+  return print(buf);
+}
+
+size_t Print::print(double v)
+{
+  char buf[40];
+  snprintf(buf, sizeof(buf), "%.2f", v);
+  return print(buf);
+}
+
+size_t Stream::readBytes(uint8_t *buffer, size_t length)
+{
+  size_t n=0;
+  while( n<length && available()>0 ) buffer[n++]=read();
+  return n;
+}
@@ -0,0 +1,84 @@
+/* (C) 2018 by nsg
+ * Minimal Arduino core shim for building CasioSerial on a Linux host.
+ *
+ * Only what the library and the host tools use is provided: AVR program
+ * memory accessors, dtostre(), millis()/micros() and Print/Stream classes.
+ * Serial is a debug console attached to stdout.
+ */
+#ifndef ARDUINO_HOST_H
+#define ARDUINO_HOST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+// Program memory is ordinary memory on the host
+#define PROGMEM
+#define memcpy_P memcpy
+#define memcmp_P memcmp
+#define strncpy_P strncpy
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+#define pgm_read_ptr(p) (*(const void * const *)(p))
+
+// avr-libc dtostre() flags
+#define DTOSTR_ALWAYS_SIGN 0x01
+#define DTOSTR_PLUS_SIGN   0x02
+#define DTOSTR_UPPERCASE   0x04
+char *dtostre(double val, char *s, unsigned char prec, unsigned char flags);
+
+unsigned long millis();
+unsigned long micros();
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t b)=0;
+  virtual size_t write(const uint8_t *buffer, size_t size);
+  size_t write(const char *str) { return write((const uint8_t *)str, strlen(str)); }
+  virtual int availableForWrite() { return 0; }
+
+  size_t print(const char *s) { return write(s); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(int v) { return print((long)v); }
+  size_t print(unsigned int v) { return print((unsigned long)v); }
+  size_t print(long v);
+  size_t print(unsigned long v);
+  size_t print(double v);
+  size_t println() { return write("\r\n"); }
+  template<typename T> size_t println(T v) { return print(v)+println(); }
+};
+
+class Stream: public Print {
+public:
+  virtual int available()=0;
+  virtual int read()=0;
+  virtual int peek()=0;
+  // Unlike Arduino's timed version, returns as soon as no more data is
+  // available.
+  size_t readBytes(uint8_t *buffer, size_t length);
+  size_t readBytes(char *buffer, size_t length) { return readBytes((uint8_t *)buffer, length); }
+};
+
+// Debug console
+class HardwareSerial: public Stream {
+public:
+  void begin(unsigned long) {}
+  int available() { return 0; }
+  int read() { return -1; }
+  int peek() { return -1; }
+  size_t write(uint8_t b) { return fwrite(&b, 1, 1, stdout); }
+  size_t write(const uint8_t *buffer, size_t size) { return fwrite(buffer, 1, size, stdout); }
+  using Print::write;
+  int availableForWrite() { return 64; }
+};
+
+extern HardwareSerial Serial;
+
+#endif
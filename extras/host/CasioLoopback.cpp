@@ -0,0 +1,24 @@
+// (C) 2018 by nsg
+#include "CasioLoopback.h"
+
+int CasioPipe::pop()
+{
+  if( 0==count ) return -1;
+  int b=data[tail];
+  tail=(tail+1)%CASIO_PIPE_SIZE;
+  --count;
+  if( NULL!=on_pop ) (*on_pop)();
+  return b;
+}
+
+bool CasioPipe::push(byte b)
+{
+  if( count>=CASIO_PIPE_SIZE ) return false;
+  data[head]=b;
+  head=(head+1)%CASIO_PIPE_SIZE;
+  ++count;
+  ++total;
+  if( NULL!=capture ) fprintf(capture, "%.6f,%c,0x%02x\n", micros()/1e6, line, b);
+  if( NULL!=on_push ) (*on_push)();
+  return true;
+}
@@ -0,0 +1,64 @@
+/* (C) 2018 by nsg
+ * In-memory serial link for the host build.
+ *
+ * A CasioLoopback is a pair of byte pipes with a Stream endpoint on each
+ * side: .host is given to casio_serial, .calc to a virtual calculator. Pipes
+ * have the capacity of an AVR HardwareSerial buffer, so availableForWrite()
+ * behaves like on a board and flow control paths get exercised.
+ *
+ * Pipes can call back when a byte is pushed or popped, the equivalent of
+ * UART receive and transmit-ready interrupts, to drive casio_poll() by events.
+ */
+#ifndef CASIO_LOOPBACK_H
+#define CASIO_LOOPBACK_H
+
+#include "Arduino.h"
+
+#define CASIO_PIPE_SIZE 64
+
+class CasioPipe {
+public:
+  CasioPipe(): total(0), on_push(NULL), on_pop(NULL), capture(NULL), line('?'),
+    head(0), tail(0), count(0) {}
+  int available() const { return count; }
+  int space() const { return CASIO_PIPE_SIZE-count; }
+  int peek() const { return count?data[tail]:-1; }
+  int pop();
+  bool push(byte b);
+  unsigned long total; // bytes ever pushed
+  // serialEvent-style callbacks: data arrived, room was made
+  void (*on_push)();
+  void (*on_pop)();
+  // log pushed bytes as "seconds,line,byte" lines, the input of casio_sniff
+  FILE *capture;
+  char line; // 'c' for calculator to host, 'h' for host to calculator
+private:
+  byte data[CASIO_PIPE_SIZE];
+  int head, tail, count;
+};
+
+class CasioLoopbackPort: public Stream {
+public:
+  CasioLoopbackPort(CasioPipe *rx, CasioPipe *tx): rx(rx), tx(tx) {}
+  int available() { return rx->available(); }
+  int read() { return rx->pop(); }
+  int peek() { return rx->peek(); }
+  size_t write(uint8_t b) { return tx->push(b)?1:0; }
+  using Print::write;
+  int availableForWrite() { return tx->space(); }
+private:
+  CasioPipe *rx, *tx;
+};
+
+class CasioLoopback {
+public:
+  CasioLoopback(): host(&to_host, &to_calc), calc(&to_calc, &to_host) {
+    to_host.line='c';
+    to_calc.line='h';
+  }
+  void capture(FILE *f) { to_host.capture=to_calc.capture=f; }
+  CasioPipe to_host, to_calc;
+  CasioLoopbackPort host, calc;
+};
+
+#endif
@@ -0,0 +1,304 @@
+// (C) 2018 by nsg
+#include "CasioVirtualCalc.h"
+#include "CasioSerial.h"
+
+#define VC_ATT 0x15
+#define VC_READY 0x13
+#define VC_ACK 0x06
+#define VC_RETRY 0x05
+
+static const byte VC_END[CASIO_VC_PACKET]={
+ ':','E','N','D', 0xff,
+ 0xff, 0xff, 0xff, 0xff, 0xff,  0xff, 0xff, 0xff, 0xff, 0xff,
+ 0xff, 0xff, 0xff, 0xff, 0xff,  0xff, 0xff, 0xff, 0xff, 0xff,
+ 0xff, 0xff, 0xff, 0xff, 0xff,  0xff, 0xff, 0xff, 0xff, 0xff,
+ 0xff, 0xff, 0xff, 0xff, 0xff,  0xff, 0xff, 0xff, 0xff, 0xff,
+ 0xff, 0xff, 0xff, 0xff,
+ 'V'
+};
+
+CasioVirtualCalc::CasioVirtualCalc(Stream *port)
+  : received(0.0), received_im(0.0), completed(0), errors(0), noise(0),
+    garbled(0), port(port), index(0), data_size(16), data_count(1), packets(0)
+{
+}
+
+void CasioVirtualCalc::write(const byte *data, int size)
+{
+  Step s;
+  s.op=VC_WRITE;
+  s.size=size;
+  memcpy(s.data, data, size);
+  script.push_back(s);
+}
+
+void CasioVirtualCalc::expect(byte b)
+{
+  Step s;
+  s.op=VC_EXPECT;
+  s.size=1;
+  s.data[0]=b;
+  script.push_back(s);
+}
+
+void CasioVirtualCalc::packet(int size)
+{
+  Step s;
+  s.op=VC_PACKET;
+  s.size=size;
+  script.push_back(s);
+}
+
+// data packets announced by the last :VAL, each acknowledged
+void CasioVirtualCalc::elements()
+{
+  Step s;
+  s.op=VC_ELEMENTS;
+  s.size=0;
+  script.push_back(s);
+}
+
+void CasioVirtualCalc::done()
+{
+  Step s;
+  s.op=VC_DONE;
+  s.size=0;
+  script.push_back(s);
+}
+
+// :VAL/:REQ header
+void CasioVirtualCalc::header(byte *buffer, const char *type, const char *rank,
+  const char *name, int rows, int cols, bool complex)
+{
+  memcpy(buffer, VC_END, CASIO_VC_PACKET);
+  memcpy(buffer, type, 4);
+  buffer[4]=0;
+  memcpy(buffer+5, rank, 2);
+  buffer[7]=rows>>8;
+  buffer[8]=rows;
+  buffer[9]=cols>>8;
+  buffer[10]=cols;
+  memcpy(buffer+11, name, strlen(name));
+  memcpy(buffer+19, "Variable", 8);
+  buffer[27]=complex?'C':'R';
+  buffer[28]=0x0a;
+  buffer[49]=casio_checksum(buffer, 49);
+}
+
+// data packet of one value, followed by acknowledgement from the host
+void CasioVirtualCalc::element(int row, int col, double value, double im)
+{
+  byte packet[26];
+  int size=0.0!=im?26:16;
+  memset(packet, 0, sizeof(packet));
+  packet[0]=':';
+  packet[1]=row>>8;
+  packet[2]=row;
+  packet[3]=col>>8;
+  packet[4]=col;
+  casio_number_format(packet+5, value);
+  if( 0.0!=im ) {
+    packet[13]|=0x80;
+    casio_number_format(packet+15, im);
+  }
+  packet[size-1]=casio_checksum(packet, size-1);
+  write(packet, size);
+  expect(VC_ACK);
+}
+
+void CasioVirtualCalc::send(char name, double value, double im)
+{
+  char n[2]={ name, 0 };
+  header(buffer, ":VAL", "VM", n, 1, 1, 0.0!=im);
+  write(VC_ATT);
+  expect(VC_READY);
+  write(buffer, CASIO_VC_PACKET);
+  expect(VC_ACK);
+  element(1, 1, value, im);
+  write(VC_END, CASIO_VC_PACKET);
+  done();
+}
+
+void CasioVirtualCalc::receive(char name)
+{
+  char n[2]={ name, 0 };
+  header(buffer, ":REQ", "VM", n, 1, 1);
+  write(VC_ATT);
+  expect(VC_READY);
+  write(buffer, CASIO_VC_PACKET);
+  expect(VC_ACK);
+  write(VC_ACK);
+  packet(CASIO_VC_PACKET); // :VAL
+  write(VC_ACK);
+  elements();
+  packet(CASIO_VC_PACKET); // :END
+  done();
+}
+
+void CasioVirtualCalc::send_list(int number, const double *values, int count)
+{
+  char n[9];
+  snprintf(n, sizeof(n), "List %d", number);
+  header(buffer, ":VAL", "LT", n, count, 1);
+  write(VC_ATT);
+  expect(VC_READY);
+  write(buffer, CASIO_VC_PACKET);
+  expect(VC_ACK);
+  for( int i=0; i<count; ++i ) element(i+1, 1, values[i]);
+  write(VC_END, CASIO_VC_PACKET);
+  done();
+}
+
+void CasioVirtualCalc::receive_list(int number)
+{
+  char n[9];
+  snprintf(n, sizeof(n), "List %d", number);
+  header(buffer, ":REQ", "LT", n, 0, 0);
+  write(VC_ATT);
+  expect(VC_READY);
+  write(buffer, CASIO_VC_PACKET);
+  expect(VC_ACK);
+  write(VC_ACK);
+  packet(CASIO_VC_PACKET); // :VAL
+  write(VC_ACK);
+  elements();
+  packet(CASIO_VC_PACKET); // :END
+  done();
+}
+
+void CasioVirtualCalc::send_matrix(char name, const double *values,
+  int rows, int cols)
+{
+  char n[6]={ 'M', 'a', 't', ' ', name, 0 };
+  header(buffer, ":VAL", "MT", n, rows, cols);
+  write(VC_ATT);
+  expect(VC_READY);
+  write(buffer, CASIO_VC_PACKET);
+  expect(VC_ACK);
+  for( int r=0; r<rows; ++r )
+    for( int c=0; c<cols; ++c ) element(r+1, c+1, values[r*cols+c]);
+  write(VC_END, CASIO_VC_PACKET);
+  done();
+}
+
+void CasioVirtualCalc::receive_matrix(char name)
+{
+  char n[6]={ 'M', 'a', 't', ' ', name, 0 };
+  header(buffer, ":REQ", "MT", n, 0, 0);
+  write(VC_ATT);
+  expect(VC_READY);
+  write(buffer, CASIO_VC_PACKET);
+  expect(VC_ACK);
+  write(VC_ACK);
+  packet(CASIO_VC_PACKET); // :VAL
+  write(VC_ACK);
+  elements();
+  packet(CASIO_VC_PACKET); // :END
+  done();
+}
+
+void CasioVirtualCalc::unplug()
+{
+  header(buffer, ":VAL", "VM", "A", 1, 1);
+  write(VC_ATT);
+  expect(VC_READY);
+  write(buffer, CASIO_VC_PACKET/2);
+  done();
+}
+
+void CasioVirtualCalc::check_packet(const byte *buffer, int size)
+{
+  if( buffer[size-1]!=casio_checksum((byte *)buffer, size-1) ) {
+    ++errors;
+    return;
+  }
+  if( CASIO_VC_PACKET==size ) {
+    if( 0==memcmp(buffer, ":VAL", 4) ) {
+      data_size=buffer[27]=='C'?26:16;
+      data_count=((buffer[7]<<8)|buffer[8])*((buffer[9]<<8)|buffer[10]);
+      received_values.clear();
+    }
+  } else if( ':'==buffer[0] ) {
+    received=casio_number_parse((byte *)buffer+5);
+    received_im=size==26?casio_number_parse((byte *)buffer+15):0.0;
+    received_values.push_back(received);
+  }
+}
+
+// drop the rest of a failed transaction
+void CasioVirtualCalc::abort()
+{
+  ++errors;
+  while( !script.empty() && script.front().op!=VC_DONE ) script.pop_front();
+  if( !script.empty() ) script.pop_front();
+  index=0;
+}
+
+bool CasioVirtualCalc::step()
+{
+  int rd;
+  while( !script.empty() ) {
+    Step &s=script.front();
+    switch( s.op ) {
+      case VC_WRITE:
+        if( 0==index && s.size>1 && script.size()>1 && script[1].op==VC_EXPECT ) {
+          // a packet to be acknowledged, keep it in case it has to be resent
+          sent=s;
+          sent.op=VC_RESEND;
+          if( noise>0 && 0==++packets%noise ) {
+            s.data[s.size/2]^=0x10;
+            ++garbled;
+          }
+        }
+        // fall through
+      case VC_RESEND:
+        while( index<s.size ) {
+          int n=port->availableForWrite();
+          if( n<=0 ) return true;
+          if( n>s.size-index ) n=s.size-index;
+          index+=port->write(s.data+index, n);
+        }
+        break;
+      case VC_EXPECT:
+        if( 0==port->available() ) return true;
+        rd=port->read();
+        if( VC_RETRY==rd && VC_ACK==s.data[0] ) {
+          // write the last packet again, then expect the same answer
+          script.push_front(sent);
+          continue;
+        }
+        if( rd!=s.data[0] ) {
+          abort();
+          continue;
+        }
+        break;
+      case VC_PACKET:
+        if( 0==s.size ) s.size=data_size;
+        while( index<s.size ) {
+          if( 0==port->available() ) return true;
+          buffer[index++]=port->read();
+        }
+        check_packet(buffer, s.size);
+        break;
+      case VC_ELEMENTS:
+        // replace with a packet and an acknowledgement per element
+        {
+          std::deque<Step> rest;
+          script.pop_front();
+          rest.swap(script);
+          for( int i=0; i<data_count; ++i ) {
+            packet(0);
+            write(VC_ACK);
+          }
+          script.insert(script.end(), rest.begin(), rest.end());
+        }
+        continue;
+      case VC_DONE:
+        ++completed;
+        break;
+    }
+    index=0;
+    script.pop_front();
+  }
+  return false;
+}
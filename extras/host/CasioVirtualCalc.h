@@ -0,0 +1,87 @@
+/* (C) 2018 by nsg
+ * Scripted calculator peer for the host build.
+ *
+ * Plays the calculator side of SEND() and RECEIVE() as drawn in
+ * CasioSerial.h. Operations are queued with send()/receive() and carried out
+ * by step(), which never blocks: it moves whatever bytes the link allows and
+ * returns, so it can be interleaved with casio_poll() in a single thread.
+ *
+ * --Receive()     --Send()
+ * Casio MCU       Casio MCU
+ * $15   $13       $15   $13
+ * :REQ  $06       :VAL  $06
+ * $06   :VAL      :0101 $06
+ * $06   :0101     :END
+ * $06   :END
+ */
+#ifndef CASIO_VIRTUALCALC_H
+#define CASIO_VIRTUALCALC_H
+
+#include "Arduino.h"
+#include <deque>
+#include <vector>
+
+#define CASIO_VC_PACKET 50
+
+class CasioVirtualCalc {
+public:
+  CasioVirtualCalc(Stream *port);
+  // queue SEND(name) of a value, complex if im is not 0
+  void send(char name, double value, double im=0.0);
+  // queue RECEIVE(name); the value ends up in .received and .received_im
+  void receive(char name);
+  // queue SEND(List n) of count values
+  void send_list(int number, const double *values, int count);
+  // queue RECEIVE(List n); elements end up in .received_values
+  void receive_list(int number);
+  // queue SEND(Mat name) of a rows by cols matrix stored row by row
+  void send_matrix(char name, const double *values, int rows, int cols);
+  // queue RECEIVE(Mat name); elements end up in .received_values row by row
+  void receive_matrix(char name);
+  // queue a SEND() that falls silent in the middle of its header, as if the
+  // cable was pulled
+  void unplug();
+  // advance the script; returns false when there is nothing left to do
+  bool step();
+  bool idle() const { return script.empty(); }
+
+  double received; // value delivered by the last RECEIVE()
+  double received_im; // and its imaginary part
+  std::vector<double> received_values; // all elements of the last RECEIVE()
+  unsigned long completed; // finished transactions
+  unsigned long errors; // protocol violations seen from the host
+  // garble every noise-th packet that is to be acknowledged, 0 for a clean
+  // line; the host is expected to ask for it again
+  int noise;
+  unsigned long garbled; // packets garbled so far
+
+private:
+  enum { VC_WRITE, VC_RESEND, VC_EXPECT, VC_PACKET, VC_ELEMENTS, VC_DONE };
+  struct Step {
+    byte op;
+    byte size;
+    byte data[CASIO_VC_PACKET];
+  };
+  void write(const byte *data, int size);
+  void write(byte b) { write(&b, 1); }
+  void expect(byte b);
+  void packet(int size);
+  void elements();
+  void done();
+  void header(byte *buffer, const char *type, const char *rank,
+    const char *name, int rows, int cols, bool complex=false);
+  void element(int row, int col, double value, double im=0.0);
+  void check_packet(const byte *buffer, int size);
+  void abort();
+
+  Stream *port;
+  std::deque<Step> script;
+  byte buffer[CASIO_VC_PACKET];
+  int index; // progress within the current step
+  int data_size; // size of :0101 announced by the last :VAL
+  int data_count; // and the number of them
+  Step sent; // last packet written, as it should have been
+  unsigned long packets; // packets written
+};
+
+#endif
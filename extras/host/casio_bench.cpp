@@ -0,0 +1,242 @@
+/* (C) 2018 by nsg
+ * Microbenchmarks for CasioSerial hot paths.
+ *
+ * usage: casio_bench [-j] [iterations]
+ *
+ * With -j every result is printed as a JSON object on its own line, tagged
+ * with the library version, to be collected and compared across releases.
+ */
+#include "Arduino.h"
+#include "CasioSerial.h"
+#include "CasioLoopback.h"
+#include "CasioVirtualCalc.h"
+#include <time.h>
+#include <unistd.h>
+
+#ifndef CASIO_VERSION
+#define CASIO_VERSION "unknown"
+#endif
+
+static long iterations=1000000;
+static volatile unsigned long sink;
+static bool json;
+
+static double now_ns()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec*1e9+t.tv_nsec;
+}
+
+static void report(const char *bench, const char *variant, int n, double ns)
+{
+  if( json )
+    printf("{\"version\":\"%s\",\"bench\":\"%s\",\"variant\":\"%s\","
+      "\"n\":%d,\"ns_per_op\":%.2f}\n", CASIO_VERSION, bench, variant, n, ns);
+  else printf("%-10s %-8s n=%-3d %8.2f ns/op\n", bench, variant, n, ns);
+}
+
+/*
+ * Number codec of release 1.0.0, dtostre() and pow() based, kept as the
+ * baseline for the integer codec.
+ */
+#define LEGACY_EXPPOS 1
+#define LEGACY_NEG 0x50
+
+static int legacy_fbcd(byte b)
+{
+  return (b & 0x0f)+10*(b>>4);
+}
+
+static byte legacy_bcd(int v)
+{
+  if( v<0 ) return 0;
+  if( v>99 ) return 99;
+  return (v%10) | ((v/10)<<4);
+}
+
+static byte *legacy_number_format(byte *buffer, double value)
+{
+  char fmtbuf[32];
+  int sign=0;
+  int exp;
+  dtostre(value,fmtbuf,20,DTOSTR_ALWAYS_SIGN|DTOSTR_PLUS_SIGN);
+  if( fmtbuf[0]=='-' ) sign=sign|LEGACY_NEG;
+  if( fmtbuf[1]=='i' ) goto OVERFLOW;
+  buffer[0]=fmtbuf[1] & 0x0f;
+  for(int i=1; i<4;++i)
+    buffer[i]=((fmtbuf[1+2*i]&0x0f)<<4)|((fmtbuf[2+2*i]&0x0f));
+  buffer[4]=(fmtbuf[9]&0x0f)<<4;
+  exp=(fmtbuf[12]-'0')*10+(fmtbuf[13]-'0');
+  if(fmtbuf[11]=='-') {
+    exp=100-exp;
+    if(exp<1) {
+      exp=0;
+      memset(&buffer[0],0x00,8);
+    }
+  } else {
+    sign=sign|LEGACY_EXPPOS;
+  }
+  if(exp>99) {
+OVERFLOW:
+    exp=99;
+    memset(&buffer[1],0x99,7);
+    buffer[0]=0x09;
+  }
+  buffer[8]=sign;
+  buffer[9]=legacy_bcd(exp);
+  return buffer;
+}
+
+static double legacy_number_parse(byte *buffer)
+{
+  double r=0.0;
+  int exp,sign;
+  for( int i=0; i<8; ++i ) r=r*100.0+legacy_fbcd(buffer[i]);
+  r=r/1e14;
+  sign=buffer[8];
+  exp=legacy_fbcd(buffer[9]);
+  if( 0==(sign & LEGACY_EXPPOS) ) exp=exp-100;
+  if( 0!=(sign & LEGACY_NEG ) ) r=-r;
+  return r*pow(10.0,exp);
+}
+
+#define CODEC_VALUES 4096
+static double values[CODEC_VALUES];
+static byte packed[CODEC_VALUES][10];
+
+// float values of both signs spread over exponents -30..30
+static void fill_values()
+{
+  srand(1);
+  for( int i=0; i<CODEC_VALUES; ++i ) {
+    double m=1.0+rand()/(RAND_MAX+1.0)*9.0;
+    int e=rand()%61-30;
+    values[i]=(float)((rand()&1?-m:m)*pow(10.0,e));
+  }
+}
+
+static void bench_codec(const char *variant,
+  byte *(*format)(byte *, double), double (*parse)(byte *))
+{
+  long rounds=iterations/CODEC_VALUES+1;
+
+  double t=now_ns();
+  for( long k=0; k<rounds; ++k )
+    for( int i=0; i<CODEC_VALUES; ++i ) format(packed[i], values[i]);
+  report("format", variant, 10, (now_ns()-t)/(rounds*CODEC_VALUES));
+
+  double sum=0.0;
+  t=now_ns();
+  for( long k=0; k<rounds; ++k )
+    for( int i=0; i<CODEC_VALUES; ++i ) sum+=parse(packed[i]);
+  report("parse", variant, 10, (now_ns()-t)/(rounds*CODEC_VALUES));
+  sink+=(unsigned long)sum;
+}
+
+static CasioMailBox boxes[CASIO_NAMES];
+
+static void bench_lookup(int n)
+{
+  char names[CASIO_NAMES];
+  for( int i=0; i<n; ++i ) {
+    boxes[i].name=names[i]=casio_index_name(i);
+    boxes[i].immediate=true;
+  }
+  fill_static_links(&boxes[0], n);
+  casio_inboxes=&boxes[0];
+  casio_index_mailboxes();
+
+  double t=now_ns();
+  for( long k=0; k<iterations; ++k )
+    sink+=(unsigned long)get_mailbox(&casio_inboxes, names[k%n]);
+  report("lookup", "list", n, (now_ns()-t)/iterations);
+
+  t=now_ns();
+  for( long k=0; k<iterations; ++k )
+    sink+=(unsigned long)get_inbox(names[k%n]);
+  report("lookup", "table", n, (now_ns()-t)/iterations);
+}
+
+static void bench_checksum(int n)
+{
+  byte packet[50];
+  for( int i=0; i<n; ++i ) packet[i]=':'+i;
+  double t=now_ns();
+  for( long k=0; k<iterations; ++k ) {
+    packet[1]=(byte)k;
+    sink+=casio_checksum(packet, n-1);
+  }
+  report("checksum", "packet", n, (now_ns()-t)/iterations);
+}
+
+/*
+ * Whole transactions through casio_poll() against the virtual calculator on
+ * the in-memory link: the cost of the protocol itself, without a UART.
+ */
+static CasioMailBox transaction_inbox[]={ MAILBOX('A',true) };
+static CasioMailBox transaction_outbox[]={ IMMEDIATE('B') };
+
+static void bench_transactions()
+{
+  CasioLoopback link;
+  CasioVirtualCalc calc(&link.calc);
+  long count=iterations/100+1;
+
+  casio_serial=&link.host;
+  fill_static_links(&transaction_inbox[0], 1);
+  fill_static_links(&transaction_outbox[0], 1);
+  casio_inboxes=&transaction_inbox[0];
+  casio_outboxes=&transaction_outbox[0];
+  casio_index_mailboxes();
+
+  double t=now_ns();
+  for( long k=0; k<count; ++k ) {
+    calc.send('A', k*0.5);
+    while( calc.step() ) casio_poll();
+    casio_poll();
+  }
+  report("poll", "send", 1, (now_ns()-t)/count);
+
+  t=now_ns();
+  for( long k=0; k<count; ++k ) {
+    POST_TO_BOX(transaction_outbox[0], k*0.5);
+    calc.receive('B');
+    while( calc.step() ) casio_poll();
+    casio_poll();
+  }
+  report("poll", "receive", 1, (now_ns()-t)/count);
+
+  if( 2*(unsigned long)count!=calc.completed || 0!=calc.errors )
+    fprintf(stderr, "%lu of %ld transactions completed, %lu errors\n",
+      calc.completed, 2*count, calc.errors);
+  casio_serial=NULL;
+}
+
+int main(int argc, char **argv)
+{
+  int opt;
+  while( (opt=getopt(argc, argv, "j"))!=-1 ) {
+    if( 'j'!=opt ) {
+      fprintf(stderr, "usage: %s [-j] [iterations]\n", argv[0]);
+      return 2;
+    }
+    json=true;
+  }
+  if( optind<argc ) iterations=atol(argv[optind]);
+
+  bench_checksum(16);
+  bench_checksum(26);
+  bench_checksum(50);
+
+  bench_lookup(3);
+  bench_lookup(10);
+  bench_lookup(CASIO_NAMES);
+
+  fill_values();
+  bench_codec("legacy", legacy_number_format, legacy_number_parse);
+  bench_codec("integer", casio_number_format, casio_number_parse);
+
+  bench_transactions();
+  return 0;
+}
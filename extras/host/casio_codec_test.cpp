@@ -0,0 +1,222 @@
+/* (C) 2018 by nsg
+ * Checks of the number codec against the C library's decimal conversions.
+ *
+ * usage: casio_codec_test [random count]
+ *
+ * casio_number_format() must give the digits of printf's exact expansion,
+ * rounded half up as the calculator does, and casio_number_parse() the number
+ * strtod() gives for them. Edge cases are checked, then random numbers and
+ * random 15-digit numbers over the calculator's range.
+ *
+ * Built with CASIO_FLOAT_CODEC (casio_codec_test_float, see the Makefile) it
+ * checks the 9-digit codec of boards with 4-byte doubles instead: values are
+ * floats, parsing rounds to 9 digits by the 10th and then to the nearest
+ * float, and every float must come back unchanged.
+ * Exits with 1 if any check fails.
+ */
+#include "Arduino.h"
+#include "CasioSerial.h"
+#include <float.h>
+
+#define CODEC_EXPPOS 1
+#define CODEC_NEG 0x50
+
+#ifdef CASIO_FLOAT_CODEC
+#define CODEC_DIGITS 9
+#define CODEC_LIM 1000000000ULL
+#define CODEC_EXP_MIN -50 // random numbers, a bit beyond a float's range
+#define CODEC_EXP_MAX 40
+typedef float codec_value;
+#else
+#define CODEC_DIGITS 15
+#define CODEC_LIM 1000000000000000ULL
+#define CODEC_EXP_MIN -99
+#define CODEC_EXP_MAX 99
+typedef double codec_value;
+#endif
+
+static unsigned long checked, failed;
+
+static byte to_bcd(int v)
+{
+  return (v%10) | ((v/10)<<4);
+}
+
+// a calculator number of 15 digits m, 10^exp for the first one
+static void encode(byte *buffer, uint64_t m, int exp, byte sign)
+{
+  for( int i=7; i>0; --i, m/=100 ) buffer[i]=to_bcd(m%100);
+  buffer[0]=m;
+  buffer[8]=sign|(exp>=0?CODEC_EXPPOS:0);
+  buffer[9]=to_bcd(exp>=0?exp:100+exp);
+}
+
+// the calculator's number for x: CODEC_DIGITS digits from the exact decimal
+// expansion printf gives, halves rounded up
+static void expected(byte *buffer, double x)
+{
+  char s[160];
+  memset(buffer, 0, 10);
+  if( x==0.0 ) {
+    buffer[8]=CODEC_EXPPOS;
+    return;
+  }
+  byte sign=x<0?CODEC_NEG:0;
+  if( isnan(x) ) sign=0;
+  int exp=100;
+  uint64_t m=0;
+  if( isfinite(x) ) {
+    snprintf(s, sizeof(s), "%.120e", fabs(x));
+    exp=atoi(strchr(s, 'e')+1);
+    m=s[0]-'0';
+    for( int i=2; i<=CODEC_DIGITS; ++i ) m=m*10+(s[i]-'0');
+    if( s[CODEC_DIGITS+1]>='5' && ++m==CODEC_LIM ) {
+      m/=10;
+      ++exp;
+    }
+  }
+  if( exp>99 ) {
+    buffer[0]=0x09;
+    memset(&buffer[1], 0x99, 7);
+    buffer[8]=sign|CODEC_EXPPOS;
+    buffer[9]=0x99;
+    return;
+  }
+  if( exp<-99 ) {
+    buffer[8]=CODEC_EXPPOS; // flushed to zero
+    return;
+  }
+  for( int i=CODEC_DIGITS; i<15; ++i ) m*=10;
+  encode(buffer, m, exp, sign);
+}
+
+// the value of a calculator number, through strtod()
+static codec_value expected_value(const byte *buffer)
+{
+  char s[40];
+  int exp=(buffer[9]>>4)*10+(buffer[9]&0x0f);
+  if( 0==(buffer[8]&CODEC_EXPPOS) ) exp-=100;
+  uint64_t m=buffer[0]&0x0f;
+  for( int i=1; i<8; ++i ) m=m*100+(buffer[i]>>4)*10+(buffer[i]&0x0f);
+#ifdef CASIO_FLOAT_CODEC
+  // 9 digits rounded by the next one, then to the nearest float
+  bool up=m%1000000>=500000;
+  m=m/1000000+up;
+  exp-=8;
+#else
+  exp-=14;
+#endif
+  snprintf(s, sizeof(s), "%s%llue%d", buffer[8]&CODEC_NEG?"-":"",
+    (unsigned long long)m, exp);
+#ifdef CASIO_FLOAT_CODEC
+  return strtof(s, NULL);
+#else
+  return strtod(s, NULL);
+#endif
+}
+
+static void print_number(const byte *buffer)
+{
+  for( int i=0; i<10; ++i ) printf("%02x", buffer[i]);
+}
+
+static bool same(codec_value a, codec_value b)
+{
+  return a==b || (isnan(a) && isnan(b));
+}
+
+static void check_parse(byte *buffer)
+{
+  codec_value v=casio_number_parse(buffer);
+  codec_value w=expected_value(buffer);
+  if( !same(v, w) ) {
+    printf("FAILED: parse ");
+    print_number(buffer);
+    printf(": %.17g, expected %.17g\n", (double)v, (double)w);
+    ++failed;
+  }
+}
+
+// x to the calculator and back
+static void check(codec_value x)
+{
+  byte want[10], got[10];
+  expected(want, x);
+  casio_number_format(got, x);
+  ++checked;
+  if( 0!=memcmp(want, got, 10) ) {
+    printf("FAILED: format %.17g: ", (double)x);
+    print_number(got);
+    printf(", expected ");
+    print_number(want);
+    printf("\n");
+    ++failed;
+  }
+  check_parse(want);
+#ifdef CASIO_FLOAT_CODEC
+  // 9 digits restore a float
+  codec_value back=casio_number_parse(got);
+  if( isfinite(x) && back!=x ) {
+    printf("FAILED: round trip %.9g: %.9g\n", (double)x, (double)back);
+    ++failed;
+  }
+#endif
+}
+
+static const double edges[]={
+  0.0, -0.0, 1.0, -1.0, 0.5, 0.1, 1.0/3, 2.0/3,
+  1e99, -1e99, 1e-99, -1e-99,
+  9.999999999e99, 9.99999999999999e99, -9.99999999999999e99,
+  9.999999999999995e99, 1e100, -1e100, // round up out of range
+  9.99999999999999e-100, 9.999999999999995e-100, 1e-100, // and into it
+  DBL_MAX, -DBL_MAX, DBL_MIN, -DBL_MIN, 4.9406564584124654e-324,
+  2.2250738585072009e-308, // largest subnormal
+  INFINITY, -INFINITY, NAN,
+  123456789012345.0, 999999999999999.0, 1e15, 1.23456789012345e-50,
+  -9.87654321098765e99, 1.00000000000001, 0.999999999999999,
+  // floats: limits, subnormals, a tie at the 10th digit (2^-13), 9 and 10
+  // digit integers and a value the float codec once got wrong
+  FLT_MAX, -FLT_MAX, FLT_MIN, 1.17549421e-38, 1.40129846e-45,
+  0.0001220703125, 16777216.0, 16777217.0, 999999936.0, 999999999.0, 1e9,
+  4294967296.0, 6.72140538e-11, 3.40282e38, 1e38, 1e-38, 9.99999944e-39
+};
+
+int main(int argc, char **argv)
+{
+  long count=argc>1?atol(argv[1]):100000;
+
+  for( size_t i=0; i<sizeof(edges)/sizeof(edges[0]); ++i ) check(edges[i]);
+
+  srand(1);
+#ifdef CASIO_FLOAT_CODEC
+  // random floats, any bit pattern that is a finite number
+  for( long i=0; i<count; ++i ) {
+    uint32_t bits=(uint32_t)rand()<<16^(uint32_t)rand();
+    float x;
+    memcpy(&x, &bits, sizeof(x));
+    if( isfinite(x) ) check(x);
+  }
+#else
+  // random doubles over the calculator's range and a bit beyond
+  for( long i=0; i<count; ++i ) {
+    double m=1.0+rand()/(RAND_MAX+1.0)*9.0;
+    double x=ldexp(m, rand()%700-350);
+    check(rand()&1?-x:x);
+  }
+#endif
+
+  // nearest values of random 15-digit numbers, and the numbers themselves
+  for( long i=0; i<count; ++i ) {
+    char s[40];
+    int d=1+rand()%9, a=rand()%10000000, b=rand()%10000000;
+    int exp=CODEC_EXP_MIN+rand()%(CODEC_EXP_MAX-CODEC_EXP_MIN+1);
+    snprintf(s, sizeof(s), "%d.%07d%07de%d", d, a, b, exp);
+    check(strtod(s, NULL));
+    byte buffer[10];
+    encode(buffer, (d*10000000ULL+a)*10000000ULL+b, exp, rand()&1?CODEC_NEG:0);
+    check_parse(buffer);
+  }
+
+  printf("%lu of %lu numbers failed\n", failed, checked);
+  return failed?1:0;
+}
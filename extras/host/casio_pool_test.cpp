@@ -0,0 +1,135 @@
+/* (C) 2018 by nsg
+ * Checks of mailboxes made on demand, built with CASIO_NO_STATIC_MAILBOX
+ * (see the Makefile).
+ *
+ * usage: casio_pool_test
+ *
+ * Exits with 1 if any check fails.
+ */
+#include "Arduino.h"
+#include "CasioSerial.h"
+#include "CasioLoopback.h"
+#include "CasioVirtualCalc.h"
+
+#ifdef CASIO_STATIC_MAILBOX
+#error casio_pool_test needs a library without CASIO_STATIC_MAILBOX
+#endif
+
+static CasioLoopback link;
+static CasioVirtualCalc calc(&link.calc);
+static unsigned long failed;
+
+static void check(bool ok, const char *what)
+{
+  if( ok ) return;
+  printf("FAILED: %s\n", what);
+  ++failed;
+}
+
+static void run()
+{
+  while( calc.step() ) casio_poll();
+  casio_poll();
+}
+
+// free the box of the request being served, between :REQ and its data
+static char free_on_request;
+static void free_hook(char name)
+{
+  if( name==free_on_request ) casio_free_mailbox(&casio_outboxes, name);
+}
+
+int main()
+{
+  casio_serial=&link.host;
+
+  // a box per new name, taken from the pool
+  calc.send('A', 1.5);
+  run();
+  CasioMailBox *a=get_inbox('A');
+  check(NULL!=a && 1.5==a->value && a->fresh, "inbox made by SEND(A)");
+  check(1==casio_pool.used, "one box in use");
+
+  // every name takes a box, the pool then serves no more
+  for( int i=1; i<CASIO_NAMES; ++i ) {
+    calc.send(casio_index_name(i), i);
+    run();
+  }
+  check(CASIO_POOL_SIZE==casio_pool.used, "pool full");
+  check(CASIO_POOL_SIZE==casio_pool.peak, "peak");
+  calc.receive('B');
+  run();
+  check(0==calc.errors, "RECEIVE() with the pool empty");
+  check(NULL==get_outbox('B') && 1==casio_pool.exhausted, "no outbox made");
+
+  // a freed box goes back to the pool and is found no more
+  check(casio_free_mailbox(&casio_inboxes, 'B'), "free B");
+  check(!casio_free_mailbox(&casio_inboxes, 'B'), "B freed twice");
+  check(NULL==get_inbox('B'), "B gone");
+  check(CASIO_POOL_SIZE-1==casio_pool.used, "B returned");
+  calc.receive('B');
+  run();
+  check(NULL!=get_outbox('B') && CASIO_POOL_SIZE==casio_pool.used, "outbox B made");
+  for( int i=0; i<CASIO_NAMES; ++i ) casio_free_mailbox(&casio_inboxes, casio_index_name(i));
+  check(1==casio_pool.used, "inboxes freed");
+
+  // a complex outbox freed while its value is being sent
+  CasioMailBox *c=get_outbox('C', true);
+  POST_COMPLEX_TO_BOX(*c, 1, 2);
+  free_on_request='C';
+  casio_receive_hook=free_hook;
+  calc.receive('C');
+  run();
+  casio_receive_hook=NULL;
+  check(0==calc.errors && 0==calc.received_im, "complex outbox freed mid-request");
+  check(NULL==get_outbox('C'), "C gone");
+
+  // a queued inbox freed while the calculator is held by a full queue
+  double data[2];
+  CasioQueue queue=INQUEUE(data);
+  calc.send('Q', 1);
+  run();
+  CasioMailBox *q=get_inbox('Q');
+  q->queue=&queue;
+  q->timeout=0; // hold until the queue has room
+  calc.send('Q', 2);
+  run();
+  calc.send('Q', 3);
+  for( int k=0; k<200 && calc.step(); ++k ) casio_poll();
+  check(!calc.idle(), "calculator held by the queue");
+  casio_free_mailbox(&casio_inboxes, 'Q');
+  run();
+  check(0==calc.errors && calc.idle(), "queued inbox freed while held");
+  check(1==casio_queue_count(&queue), "value of the freed box dropped");
+
+  // boxes freed from the middle and both ends of a list leave it whole
+  for( char n='E'; n<='H'; ++n ) get_outbox(n, true); // H G F E B
+  byte used=casio_pool.used;
+  check(casio_free_mailbox(&casio_outboxes, 'G'), "free G in the middle");
+  check(casio_free_mailbox(&casio_outboxes, 'H'), "free H at the head");
+  check(casio_free_mailbox(&casio_outboxes, 'B'), "free B at the tail");
+  check(used-3==casio_pool.used, "G, H and B returned");
+  CasioMailBox *f=get_outbox('F');
+  check(f==casio_outboxes && NULL!=f && 'E'==f->next->name && NULL==f->next->next,
+    "F and E left");
+  check(NULL==get_outbox('G') && NULL==get_outbox('H') && NULL==get_outbox('B'),
+    "G, H and B gone");
+
+  // a box the sketch put in front is only unlinked, the list stays whole
+  static CasioMailBox own;
+  own.name='S';
+  own.next=casio_outboxes;
+  casio_outboxes=&own;
+  check(casio_free_mailbox(&casio_outboxes, 'F'), "free F behind the sketch's box");
+  check(&own==get_outbox('S') && 'E'==own.next->name, "S and E left");
+  check(casio_free_mailbox(&casio_outboxes, 'S'), "free S");
+  check(used-4==casio_pool.used && 'E'==casio_outboxes->name, "S not pooled");
+
+  // the pool still works afterwards
+  calc.send('D', 4);
+  run();
+  check(NULL!=get_inbox('D') && 4==get_inbox('D')->value, "box after frees");
+
+  printf("%lu checks failed\n", failed);
+  return failed?1:0;
+}
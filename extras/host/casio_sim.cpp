@@ -0,0 +1,495 @@
+/* (C) 2018 by nsg
+ * Runs SEND() and RECEIVE() transactions between casio_poll() and a virtual
+ * calculator over an in-memory link and reports transactions per second.
+ *
+ * usage: casio_sim [transactions [capture.csv]]
+ *
+ * With a capture file, bytes on the main link are logged for casio_sniff.
+ */
+#include "Arduino.h"
+#include "CasioSerial.h"
+#include "CasioLoopback.h"
+#include "CasioVirtualCalc.h"
+
+#define HOLD_MS 20
+
+// synchronous producer: counts the requests
+static long produced;
+static void produce_count(CasioMailBox *box)
+{
+  POST_TO_BOX(*box, ++produced);
+}
+
+// slow sensor: the reading is completed later through the box
+static CasioMailBox *pending;
+static void produce_later(CasioMailBox *box)
+{
+  pending=box;
+}
+
+#define QUEUE_SIZE 16
+double queue_data[QUEUE_SIZE];
+CasioQueue my_queue=INQUEUE(queue_data);
+
+CasioMailBox my_inbox[]={
+  IMMEDIATE('A')
+  ,TIMEDBOX('D',HOLD_MS) // never acted upon
+  ,QUEUEDBOX('S',my_queue)
+};
+
+CasioMailBox my_outbox[]={
+  IMMEDIATE('B')
+  ,TIMEDBOX('C',HOLD_MS) // never refreshed
+  ,PRODUCER('P',true,produce_count)
+  ,PRODUCER('Q',false,produce_later)
+};
+
+#define LIST_SIZE 100
+double list_in[LIST_SIZE];
+double list_out[LIST_SIZE];
+
+CasioListBox my_list_inbox[]={
+  LISTBOX(1,true,list_in)
+};
+
+CasioListBox my_list_outbox[]={
+  LISTBOX(2,true,list_out)
+};
+
+#define MAT_ROWS 8
+#define MAT_COLS 12
+double mat_in[MAT_ROWS][MAT_COLS];
+double mat_out[MAT_ROWS][MAT_COLS];
+
+static void mat_put(CasioMatrixBox *box, int row, int col, double value)
+{
+  if( row<=MAT_ROWS && col<=MAT_COLS ) mat_in[row-1][col-1]=value;
+}
+
+static double mat_get(CasioMatrixBox *box, int row, int col)
+{
+  return mat_out[row-1][col-1];
+}
+
+CasioMatrixBox my_matrix_inbox[]={
+  MATRIXBOX('A',true,mat_put,NULL)
+};
+
+CasioMatrixBox my_matrix_outbox[]={
+  MATRIXBOX('B',true,NULL,mat_get)
+};
+
+CasioValue xyz[3][3];
+
+CasioGroupBox my_group[]={
+  GROUPBOX("XYZ",xyz)
+};
+
+static void publish_sample(double v)
+{
+  for( byte slot=0; slot<3; ++slot ) casio_group_set(&my_group[0], slot, v+slot);
+  casio_group_publish(&my_group[0]);
+}
+
+// another calculator reading the whole group between a :REQ and its data
+static void release_group(char name)
+{
+  if( 'X'==name ) my_group[0].state|=0x30;
+}
+
+static CasioLoopback link;
+static CasioVirtualCalc calc(&link.calc);
+
+// extra calculators, each on its own session with a private inbox 'A'
+#define SESSIONS 3
+static CasioLoopback session_link[SESSIONS];
+static CasioVirtualCalc *session_calc[SESSIONS];
+static CasioSession session[SESSIONS];
+static CasioMailBox session_inbox[SESSIONS][1];
+
+// values go through the calculator's decimal format
+static bool same(double a, double b)
+{
+  return fabs(a-b)<=1e-9*fabs(b);
+}
+
+// run casio_poll() against the calculator until its script is done
+static void run()
+{
+  while( calc.step() ) casio_poll();
+  casio_poll();
+#ifdef CASIO_LOG_BUFFER
+  casio_log_flush();
+#endif
+}
+
+#if CASIO_LOG_LEVEL>0
+static void print_log(byte level, const char *message)
+{
+  printf("log %d: %s\n", level, message);
+}
+#endif
+
+#ifdef CASIO_STATS
+static void print_dwell(const char *name, const CasioDwell *d)
+{
+  if( 0==d->visits ) return;
+  printf("  %-20s %8lu %10.1f", name, d->visits, (double)d->time/d->visits);
+  for( int b=0; b<CASIO_STAT_BUCKETS; ++b ) printf(" %6u", d->hist[b]);
+  printf("\n");
+}
+
+static void print_stats()
+{
+  printf("sends: %lu, receives: %lu, nacks: %lu, retries: %lu, checksum errors: %lu\n",
+    casio_stats.sends, casio_stats.receives, casio_stats.nacks,
+    casio_stats.retries, casio_stats.checksum_errors);
+  printf("resends: %lu, timeouts: %lu, expired holds: %lu\n",
+    casio_stats.resends, casio_stats.timeouts, casio_stats.expired);
+  printf("bytes in: %lu, bytes out: %lu\n",
+    casio_stats.bytes_in, casio_stats.bytes_out);
+  printf("  %-20s %8s %10s %6s %6s %6s %6s %6s %6s %6s %6s\n", "state", "visits",
+    "mean us", "<8us", "<64us", "<512us", "<4ms", "<33ms", "<262ms", "<2s", "more");
+  print_dwell("transaction", &casio_stats.transaction);
+  for( int i=0; i<CASIO_STATES; ++i )
+    print_dwell(casio_state_name(i), &casio_stats.state[i]);
+}
+#endif
+
+int main(int argc, char **argv)
+{
+  long count=argc>1?atol(argv[1]):10000;
+  unsigned long failed=0;
+
+  FILE *capture=NULL;
+  if( argc>2 && NULL==(capture=fopen(argv[2], "w")) ) {
+    perror(argv[2]);
+    return 2;
+  }
+  link.capture(capture);
+  casio_serial=&link.host;
+#if CASIO_LOG_LEVEL>0
+  casio_log_sink=print_log;
+#endif
+  fill_static_links(&my_inbox[0], sizeof(my_inbox)/sizeof(CasioMailBox));
+  fill_static_links(&my_outbox[0], sizeof(my_outbox)/sizeof(CasioMailBox));
+  casio_inboxes=&my_inbox[0];
+  casio_outboxes=&my_outbox[0];
+  fill_static_links(&my_list_inbox[0], 1);
+  fill_static_links(&my_list_outbox[0], 1);
+  casio_list_inboxes=&my_list_inbox[0];
+  casio_list_outboxes=&my_list_outbox[0];
+  fill_static_links(&my_matrix_inbox[0], 1);
+  fill_static_links(&my_matrix_outbox[0], 1);
+  casio_matrix_inboxes=&my_matrix_inbox[0];
+  casio_matrix_outboxes=&my_matrix_outbox[0];
+  fill_static_links(&my_group[0], 1);
+  casio_group_outboxes=&my_group[0];
+
+#ifdef CASIO_STATS
+  casio_stats_reset();
+#endif
+  unsigned long start=micros();
+  for( long i=0; i<count; ++i ) {
+    double v=i*0.5-1000.0;
+    calc.send('A', v);
+    run();
+    if( !my_inbox[0].fresh || !same(my_inbox[0].value, v) ) ++failed;
+    my_inbox[0].fresh=false;
+    // the one box that was sent a value, and nothing else
+    uint32_t fresh=casio_take_fresh();
+    if( casio_next_fresh(&fresh)!=&my_inbox[0] || 0!=fresh ) ++failed;
+
+    POST_TO_BOX(my_outbox[0], -v);
+    calc.receive('B');
+    run();
+    if( !same(calc.received, -v) ) ++failed;
+
+    calc.send('A', v, 2*v+1);
+    run();
+    if( !my_inbox[0].fresh || !same(my_inbox[0].value, v)
+    || !same(my_inbox[0].im, 2*v+1) ) ++failed;
+    my_inbox[0].fresh=false;
+
+    POST_COMPLEX_TO_BOX(my_outbox[0], v, -3*v-1);
+    calc.receive('B');
+    run();
+    if( !same(calc.received, v) || !same(calc.received_im, -3*v-1) ) ++failed;
+  }
+  unsigned long elapsed=micros()-start;
+  unsigned long scalars=calc.completed;
+  unsigned long scalar_bytes=link.to_host.total+link.to_calc.total;
+
+  // lists of LIST_SIZE elements, one transaction each
+  double values[LIST_SIZE];
+  unsigned long list_start=micros();
+  for( long i=0; i<count/10; ++i ) {
+    for( int j=0; j<LIST_SIZE; ++j ) values[j]=i*LIST_SIZE+j*0.25;
+    calc.send_list(1, values, LIST_SIZE);
+    run();
+    if( !my_list_inbox[0].fresh || my_list_inbox[0].size!=LIST_SIZE ) ++failed;
+    for( int j=0; j<LIST_SIZE; ++j ) if( !same(list_in[j], values[j]) ) ++failed;
+    my_list_inbox[0].fresh=false;
+
+    memcpy(list_out, values, sizeof(values));
+    my_list_outbox[0].size=LIST_SIZE;
+    calc.receive_list(2);
+    run();
+    if( calc.received_values.size()!=LIST_SIZE ) ++failed;
+    else for( int j=0; j<LIST_SIZE; ++j )
+      if( !same(calc.received_values[j], values[j]) ) ++failed;
+  }
+  unsigned long list_elapsed=micros()-list_start;
+  unsigned long lists=calc.completed-scalars;
+
+  // MAT_ROWS by MAT_COLS matrices, streamed through the callbacks
+  double m[MAT_ROWS*MAT_COLS];
+  unsigned long mat_start=micros();
+  for( long i=0; i<count/10; ++i ) {
+    for( int j=0; j<MAT_ROWS*MAT_COLS; ++j ) m[j]=i-j*0.125;
+    calc.send_matrix('A', m, MAT_ROWS, MAT_COLS);
+    run();
+    if( !my_matrix_inbox[0].fresh || my_matrix_inbox[0].rows!=MAT_ROWS
+    || my_matrix_inbox[0].cols!=MAT_COLS ) ++failed;
+    for( int j=0; j<MAT_ROWS*MAT_COLS; ++j )
+      if( !same(mat_in[j/MAT_COLS][j%MAT_COLS], m[j]) ) ++failed;
+    my_matrix_inbox[0].fresh=false;
+
+    memcpy(mat_out, m, sizeof(m));
+    my_matrix_outbox[0].rows=MAT_ROWS;
+    my_matrix_outbox[0].cols=MAT_COLS;
+    calc.receive_matrix('B');
+    run();
+    if( calc.received_values.size()!=MAT_ROWS*MAT_COLS ) ++failed;
+    else for( int j=0; j<MAT_ROWS*MAT_COLS; ++j )
+      if( !same(calc.received_values[j], m[j]) ) ++failed;
+  }
+  unsigned long mat_elapsed=micros()-mat_start;
+  unsigned long matrices=calc.completed-scalars-lists;
+
+  // SESSIONS calculators at once: each SENDs to its own inbox and RECEIVEs
+  // the shared outbox, casio_poll() serves them all
+  for( int k=0; k<SESSIONS; ++k ) {
+    session_calc[k]=new CasioVirtualCalc(&session_link[k].calc);
+    casio_add_session(&session[k], &session_link[k].host);
+    session_inbox[k][0].name='A';
+    session_inbox[k][0].immediate=true;
+    fill_static_links(&session_inbox[k][0], 1);
+    session[k].inboxes=&session_inbox[k][0];
+  }
+  unsigned long session_completed=0, session_errors=0;
+  unsigned long session_start=micros();
+  for( long i=0; i<count; ++i ) {
+    POST_TO_BOX(my_outbox[0], i);
+    for( int k=0; k<SESSIONS; ++k ) {
+      session_calc[k]->send('A', i*SESSIONS+k);
+      session_calc[k]->receive('B');
+    }
+    bool busy=true;
+    while( busy ) {
+      busy=false;
+      for( int k=0; k<SESSIONS; ++k ) busy|=session_calc[k]->step();
+      casio_poll();
+    }
+    casio_poll();
+    for( int k=0; k<SESSIONS; ++k ) {
+      if( !same(session_inbox[k][0].value, i*SESSIONS+k)
+      || !same(session_calc[k]->received, i) ) ++failed;
+    }
+  }
+  unsigned long session_elapsed=micros()-session_start;
+
+  // event driven: casio_poll() runs only when a byte arrives from the
+  // calculator or the calculator makes room for one, never from the loop
+  link.to_host.on_push=casio_poll;
+  link.to_calc.on_pop=casio_poll;
+  unsigned long event_completed=calc.completed;
+  unsigned long event_start=micros();
+  for( long i=0; i<count; ++i ) {
+    calc.send('A', -i);
+    POST_TO_BOX(my_outbox[0], 2*i);
+    calc.receive('B');
+    for( long guard=0; calc.step(); ++guard )
+      if( guard>1000 ) {
+        ++failed; // stalled without a poll from the loop
+        break;
+      }
+    if( !same(my_inbox[0].value, -i) || !same(calc.received, 2*i)
+    || !casio_idle() ) ++failed;
+  }
+  unsigned long event_elapsed=micros()-event_start;
+  event_completed=calc.completed-event_completed;
+  link.to_host.on_push=NULL;
+  link.to_calc.on_pop=NULL;
+
+  // a noisy line: every 7th packet arrives garbled and is sent again
+  unsigned long noise_completed=calc.completed;
+  calc.noise=7;
+  for( long i=0; i<count/10; ++i ) {
+    calc.send('A', i+0.5);
+    run();
+    if( !same(my_inbox[0].value, i+0.5) ) ++failed;
+    POST_TO_BOX(my_outbox[0], -i);
+    calc.receive('B');
+    run();
+    if( !same(calc.received, -i) ) ++failed;
+  }
+  calc.noise=0;
+  noise_completed=calc.completed-noise_completed;
+
+  // values produced on request only
+  for( long i=0; i<count/10; ++i ) {
+    calc.receive('P');
+    run();
+    if( !same(calc.received, i+1) ) ++failed;
+
+    pending=NULL;
+    calc.receive('Q');
+    for( int k=0; k<10; ++k ) {
+      calc.step();
+      casio_poll();
+    }
+    if( NULL==pending || calc.idle() ) ++failed; // calculator should wait
+    else POST_TO_BOX(*pending, -i);
+    run();
+    if( !same(calc.received, -i) ) ++failed;
+  }
+  if( produced!=count/10 ) ++failed;
+
+  // bursts of SEND(S) faster than the firmware drains them: the queue holds
+  // the calculator when full and nothing is lost
+#define BURST 40
+  for( long i=0; i<count/100; ++i ) {
+    double v;
+    int taken=0;
+    for( int j=0; j<BURST; ++j ) calc.send('S', i*BURST+j);
+    for( long k=0; calc.step(); ++k ) {
+      casio_poll();
+      if( 0==k%8 && casio_queue_get(&my_queue, &v) && !same(v, i*BURST+taken++) ) ++failed;
+    }
+    casio_poll();
+    while( casio_queue_get(&my_queue, &v) )
+      if( !same(v, i*BURST+taken++) ) ++failed;
+    if( taken!=BURST ) ++failed;
+  }
+  if( my_queue.dropped ) ++failed;
+
+  // with a timeout, a value that finds the queue full is dropped once the
+  // hold expires, and the box is not marked fresh for it
+  my_inbox[2].timeout=HOLD_MS;
+  for( int j=0; j<QUEUE_SIZE-1; ++j ) calc.send('S', j);
+  run();
+  my_inbox[2].fresh=false;
+  casio_take_fresh();
+  calc.send('S', QUEUE_SIZE);
+  run();
+  if( 1!=my_queue.dropped || my_inbox[2].fresh
+  || 0!=(casio_take_fresh()&CASIO_FRESH_BIT('S')) ) ++failed;
+  for( double v; casio_queue_get(&my_queue, &v); ) ;
+  my_queue.dropped=0;
+  my_inbox[2].timeout=0;
+
+  // RECEIVE(X):RECEIVE(Y):RECEIVE(Z) gets one sample while new ones are
+  // published in between; the sequence read again gets the newest
+  for( long i=0; i<count/10; ++i ) {
+    publish_sample(i*10);
+    for( byte slot=0; slot<3; ++slot ) {
+      calc.receive("XYZ"[slot]);
+      run();
+      if( !same(calc.received, i*10+slot) ) ++failed;
+      publish_sample(i*10+5);
+    }
+    for( int k=0; k<3; ++k ) {
+      char name="YXZ"[k];
+      calc.receive(name);
+      run();
+      if( !same(calc.received, i*10+5+(name-'X')) ) ++failed;
+      publish_sample(i*10+7);
+    }
+  }
+  // the latch released meanwhile, the sample latched for the :REQ is served
+  publish_sample(100);
+  casio_receive_hook=release_group;
+  calc.receive('X');
+  run();
+  casio_receive_hook=NULL;
+  if( !same(calc.received, 100) ) ++failed;
+
+  // holds released by mailbox timeouts
+  unsigned long hold_start=millis();
+  POST_TO_BOX(my_outbox[1], 42);
+  my_outbox[1].fresh=false;
+  calc.receive('C');
+  run();
+  if( !same(calc.received, 42) ) ++failed;
+  calc.send('D', 7);
+  run();
+  if( !same(my_inbox[1].value, 7) || !my_inbox[1].fresh ) ++failed;
+  unsigned long hold_elapsed=millis()-hold_start;
+  if( hold_elapsed<2*HOLD_MS ) ++failed;
+
+  // a calculator unplugged mid-packet is given up on after CASIO_TIMEOUT
+  calc.unplug();
+  run();
+  unsigned long unplug_start=millis();
+  while( !casio_idle() && millis()-unplug_start<2*CASIO_TIMEOUT ) casio_poll();
+  if( !casio_idle() ) ++failed;
+  unsigned long unplug_elapsed=millis()-unplug_start;
+  calc.send('A', 1);
+  run();
+  if( !same(my_inbox[0].value, 1) ) ++failed;
+
+  // loop() stalled for longer than CASIO_TIMEOUT while a whole :REQ waits
+  // in the port: it is still served
+  POST_TO_BOX(my_outbox[0], 21);
+  calc.receive('B');
+  calc.step(); // $15
+  casio_poll(); // $13
+  casio_poll(); // waiting for the header
+  calc.step(); // :REQ
+  if( 0==link.host.available() ) ++failed;
+  unsigned long stall_start=millis();
+  while( millis()-stall_start<=CASIO_TIMEOUT+100 ) ;
+  while( calc.step() && millis()-stall_start<=3*CASIO_TIMEOUT ) casio_poll();
+  if( !calc.idle() || !same(calc.received, 21) ) ++failed;
+
+  for( int k=0; k<SESSIONS; ++k ) {
+    session_completed+=session_calc[k]->completed;
+    session_errors+=session_calc[k]->errors;
+  }
+
+  printf("transactions: %lu\n", calc.completed+session_completed);
+  printf("protocol errors: %lu\n", calc.errors+session_errors);
+  printf("value mismatches: %lu\n", failed);
+  printf("bytes to host: %lu, bytes to calc: %lu\n",
+    link.to_host.total, link.to_calc.total);
+  printf("elapsed: %lu us, %.0f transactions/s\n",
+    elapsed, elapsed?scalars*1e6/elapsed:0.0);
+  // the protocol is ping-pong, so both directions add up; 10 bits per byte
+  double per_transaction=scalars?(double)scalar_bytes/scalars:0.0;
+  printf("wire time of a scalar transaction (%.0f bytes):", per_transaction);
+  static const long baud[]={ 9600, 38400, 115200 };
+  for( int k=0; k<3; ++k )
+    printf("%s %.1f ms at %ld", k?",":"", per_transaction*10e3/baud[k], baud[k]);
+  printf(" baud\n");
+  printf("lists of %d: %lu us, %.0f transactions/s\n", LIST_SIZE,
+    list_elapsed, list_elapsed?lists*1e6/list_elapsed:0.0);
+  printf("matrices of %dx%d: %lu us, %.0f transactions/s\n", MAT_ROWS, MAT_COLS,
+    mat_elapsed, mat_elapsed?matrices*1e6/mat_elapsed:0.0);
+  printf("%d sessions: %lu us, %.0f transactions/s\n", SESSIONS,
+    session_elapsed, session_elapsed?session_completed*1e6/session_elapsed:0.0);
+  printf("event driven: %lu us, %.0f transactions/s\n",
+    event_elapsed, event_elapsed?event_completed*1e6/event_elapsed:0.0);
+  printf("noisy line: %lu transactions, %lu packets garbled\n",
+    noise_completed, calc.garbled);
+  printf("2 holds of %d ms: %lu ms, unplugged calculator dropped after %lu ms\n",
+    HOLD_MS, hold_elapsed, unplug_elapsed);
+#ifdef CASIO_STATS
+  print_stats();
+#endif
+  if( NULL!=capture ) fclose(capture);
+  return (calc.errors || session_errors || failed
+    || calc.completed!=6*(unsigned long)count+14*(unsigned long)(count/10)
+       +BURST*(unsigned long)(count/100)+6+QUEUE_SIZE
+    || session_completed!=2*SESSIONS*(unsigned long)count)?1:0;
+}
@@ -0,0 +1,358 @@
+/* (C) 2018 by nsg
+ * Decoder for captured Casio serial traffic.
+ *
+ * usage: casio_sniff [-v] [capture.csv]
+ *        casio_sniff -r c|h [-v] [capture.bin|/dev/pts/N]
+ *
+ * A capture is text of "seconds,line,byte" lines, where line is c for bytes
+ * sent by the calculator and h for bytes sent by the host, e.g. as written
+ * by casio_sim or exported from a logic analyser. Lines that do not start
+ * with a digit are skipped. With -r the input is raw bytes of one line only,
+ * timestamped as they are read, which suits a pty.
+ *
+ * Packets are reassembled for each line and decoded with casio_parse_header()
+ * and casio_number_parse() of the library. Each transaction is printed on
+ * one line with the time it took and the time the calculator spent waiting
+ * for the host; -v prints every packet and control byte as well. A value
+ * counts once the other side has acknowledged its packet. A packet that
+ * stops for half of CASIO_TIMEOUT, long before the library gives up on it,
+ * or starts with an unknown header is dropped and its transaction reported
+ * incomplete.
+ */
+#include "Arduino.h"
+#include "CasioSerial.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <vector>
+
+#define SNIFF_ATT 0x15
+#define SNIFF_READY 0x13
+#define SNIFF_ACK 0x06
+#define SNIFF_RETRY 0x05
+#define SNIFF_ERROR 0x22
+
+#define SNIFF_HEADER 50
+#define SNIFF_REAL 16
+#define SNIFF_COMPLEX 26
+#define SNIFF_SHOWN 4 // elements of a list or matrix printed
+// s, longest pause within a packet: bytes of a packet come back to back, and
+// the library gives up after CASIO_TIMEOUT
+#define SNIFF_GAP (CASIO_TIMEOUT/2000.0)
+
+enum { CALC, HOST };
+static const char *line_name[2]={ "calc", "host" };
+
+static bool verbose;
+static bool one_line; // only one side is seen, which may miss the :END
+
+// packet being reassembled from one line
+struct Reassembler {
+  byte packet[SNIFF_HEADER];
+  int index;
+  int size;
+  int data_size; // size of data packets after the last :VAL on the line
+  double last; // time of the last byte
+};
+
+static Reassembler rx[2];
+
+struct Transaction {
+  bool open;
+  bool have_header;
+  CasioHeader h; // the calculator's request
+  double start;
+  double pending; // end of the last calculator packet not yet answered
+  double wait; // time the calculator spent waiting for the host
+  std::vector<double> values;
+  std::vector<double> ims;
+  int resends; // packets asked for again, by either side
+  int garbled; // packets with a bad checksum
+  bool error;
+  bool unacked; // a value waits for the other side's ACK
+  int unacked_line;
+  double unacked_re, unacked_im;
+};
+
+static Transaction tr;
+static double last_byte; // time of the last byte on either line
+static unsigned long transactions, sends, receives, failures, bytes;
+
+static void print_name(const CasioHeader *h)
+{
+  char buf[16];
+  if( CASIO_LT==h->rank ) snprintf(buf, sizeof(buf), "List %d", (byte)h->name);
+  else if( CASIO_MT==h->rank ) snprintf(buf, sizeof(buf), "Mat %c", h->name);
+  else if( (byte)h->name==CASIO_LOWR ) snprintf(buf, sizeof(buf), "r");
+  else if( (byte)h->name==CASIO_THETA ) snprintf(buf, sizeof(buf), "theta");
+  else snprintf(buf, sizeof(buf), "%c", h->name);
+  printf("%-8s", buf);
+}
+
+static void print_value(double re, double im)
+{
+  if( 0.0==im ) printf("%.15g", re);
+  else printf("%.15g%+.15gi", re, im);
+}
+
+static void finish(double t, bool complete)
+{
+  if( !tr.open ) return;
+  tr.open=false;
+  if( !tr.have_header ) {
+    // $15 and no request after it
+    if( complete ) return;
+    ++transactions;
+    ++failures;
+    printf("%12.6f  ?        -         took %.3f ms, incomplete\n", tr.start,
+      (t-tr.start)*1e3);
+    return;
+  }
+  ++transactions;
+  printf("%12.6f  %-8s ", tr.start, CASIO_VAL==tr.h.type?"SEND":"RECEIVE");
+  print_name(&tr.h);
+  printf(" ");
+  if( CASIO_VM==tr.h.rank ) {
+    if( tr.values.empty() ) printf("-");
+    else print_value(tr.values[0], tr.ims[0]);
+  } else {
+    printf("[");
+    for( size_t i=0; i<tr.values.size() && i<SNIFF_SHOWN; ++i ) {
+      if( i ) printf(", ");
+      print_value(tr.values[i], tr.ims[i]);
+    }
+    if( tr.values.size()>SNIFF_SHOWN ) printf(", ...");
+    printf("] (%zu)", tr.values.size());
+  }
+  printf("  took %.3f ms, waited %.3f ms", (t-tr.start)*1e3, tr.wait*1e3);
+  if( tr.resends ) printf(", %d resent", tr.resends);
+  if( tr.garbled ) printf(", %d garbled", tr.garbled);
+  if( tr.error ) printf(", ERROR");
+  if( !complete ) printf(", incomplete");
+  printf("\n");
+  if( tr.error || !complete ) ++failures;
+  else if( CASIO_VAL==tr.h.type ) ++sends;
+  else ++receives;
+}
+
+// a value counts once the other side has its packet
+static void acknowledged(int line, bool ack)
+{
+  if( !tr.unacked || line==tr.unacked_line ) return;
+  tr.unacked=false;
+  if( !ack ) return;
+  tr.values.push_back(tr.unacked_re);
+  tr.ims.push_back(tr.unacked_im);
+}
+
+static void control(double t, int line, byte b)
+{
+  const char *name="?";
+  if( SNIFF_ACK==b || SNIFF_RETRY==b || SNIFF_ERROR==b )
+    acknowledged(line, SNIFF_ACK==b);
+  switch( b ) {
+    case SNIFF_ATT:
+      name="ATT";
+      if( CALC==line ) {
+        finish(t, one_line);
+        tr.open=true;
+        tr.have_header=false;
+        tr.start=t;
+        tr.pending=-1;
+        tr.wait=0;
+        tr.values.clear();
+        tr.ims.clear();
+        tr.resends=tr.garbled=0;
+        tr.error=false;
+        tr.unacked=false;
+      }
+      break;
+    case SNIFF_READY: name="READY"; break;
+    case SNIFF_ACK: name="ACK"; break;
+    case SNIFF_RETRY: name="RETRY"; ++tr.resends; break;
+    case SNIFF_ERROR: name="ERROR"; tr.error=true; break;
+  }
+  if( verbose ) printf("%12.6f  %s $%02x %s\n", t, line_name[line], b, name);
+}
+
+static void packet(double t, int line, byte *p, int size)
+{
+  if( p[size-1]!=casio_checksum(p, size-1) ) {
+    ++tr.garbled;
+    if( verbose ) printf("%12.6f  %s bad checksum\n", t, line_name[line]);
+    return;
+  }
+  if( SNIFF_HEADER==size ) {
+    CasioHeader h;
+    if( !casio_parse_header(p, &h) ) {
+      if( verbose ) printf("%12.6f  %s unknown header %.4s\n", t, line_name[line], (char *)p);
+      return;
+    }
+    if( CASIO_VAL==h.type ) rx[line].data_size=h.complex?SNIFF_COMPLEX:SNIFF_REAL;
+    if( verbose ) {
+      static const char *type[]={ ":VAL", ":REQ", ":END" };
+      printf("%12.6f  %s %s", t, line_name[line], type[h.type]);
+      if( CASIO_END!=h.type ) {
+        printf(" ");
+        print_name(&h);
+        printf(" %dx%d%s", h.rows, h.cols, h.complex?" complex":"");
+      }
+      printf("\n");
+    }
+    if( CASIO_END==h.type ) {
+      finish(t, true);
+    } else if( CALC==line ) {
+      // a new request, possibly after another in the same transaction
+      if( tr.have_header ) {
+        double start=tr.start;
+        finish(t, true);
+        control(start, CALC, SNIFF_ATT);
+        if( verbose ) printf("\n");
+      }
+      tr.open=true;
+      tr.have_header=true;
+      tr.h=h;
+    }
+    return;
+  }
+  double re=casio_number_parse(p+5);
+  double im=SNIFF_COMPLEX==size?casio_number_parse(p+15):0.0;
+  if( one_line ) {
+    // acknowledgements are on the other line, not seen
+    tr.values.push_back(re);
+    tr.ims.push_back(im);
+  } else {
+    tr.unacked=true;
+    tr.unacked_line=line;
+    tr.unacked_re=re;
+    tr.unacked_im=im;
+  }
+  if( verbose ) {
+    printf("%12.6f  %s :%d,%d ", t, line_name[line], (p[1]<<8)|p[2], (p[3]<<8)|p[4]);
+    print_value(re, im);
+    printf("\n");
+  }
+}
+
+// give up on a packet, and on its transaction
+static void drop_packet(int line, const char *why)
+{
+  Reassembler &r=rx[line];
+  if( verbose ) printf("%12.6f  %s %s, %d bytes dropped\n", r.last,
+    line_name[line], why, r.index);
+  r.index=0;
+  r.data_size=0;
+  finish(r.last, false);
+}
+
+static bool known_header(const byte *p)
+{
+  return 0==memcmp(p, ":VAL", 4) || 0==memcmp(p, ":REQ", 4)
+    || 0==memcmp(p, ":END", 4);
+}
+
+static void byte_in(double t, int line, byte b)
+{
+  Reassembler &r=rx[line];
+  ++bytes;
+  if( r.index>0 && t-r.last>SNIFF_GAP ) drop_packet(line, "packet cut off");
+  r.last=last_byte=t;
+  if( HOST==line && tr.pending>=0 ) {
+    // first answer to a calculator packet
+    tr.wait+=t-tr.pending;
+    tr.pending=-1;
+  }
+  if( 0==r.index ) {
+    if( ':'!=b ) {
+      control(t, line, b);
+      return;
+    }
+    r.size=SNIFF_HEADER;
+  }
+  r.packet[r.index++]=b;
+  if( 4==r.index && !known_header(r.packet) ) {
+    // a data packet, if one is expected after a :VAL
+    if( 0==r.data_size ) {
+      drop_packet(line, "unknown header");
+      return;
+    }
+    r.size=r.data_size;
+  }
+  if( r.index<r.size ) return;
+  r.index=0;
+  packet(t, line, r.packet, r.size);
+  if( CALC==line ) tr.pending=t;
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+static void read_raw(int fd, int line)
+{
+  byte buf[4096];
+  double t0=now();
+  ssize_t n;
+  while( (n=read(fd, buf, sizeof(buf)))>0 ) {
+    double t=now()-t0;
+    for( ssize_t i=0; i<n; ++i ) byte_in(t, line, buf[i]);
+    fflush(stdout);
+  }
+}
+
+static void read_csv(FILE *f)
+{
+  char s[256];
+  while( fgets(s, sizeof(s), f) ) {
+    char *p;
+    if( s[0]<'0' || s[0]>'9' ) continue;
+    double t=strtod(s, &p);
+    if( ','!=*p ) continue;
+    int line=('c'==p[1] || 'C'==p[1] || '0'==p[1])?CALC:HOST;
+    p=strchr(p+1, ',');
+    if( NULL==p ) continue;
+    byte_in(t, line, (byte)strtol(p+1, NULL, 0));
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int raw=-1;
+  int opt;
+  while( (opt=getopt(argc, argv, "r:v"))!=-1 ) {
+    switch( opt ) {
+      case 'r': raw='c'==optarg[0]?CALC:HOST; one_line=true; break;
+      case 'v': verbose=true; break;
+      default:
+        fprintf(stderr, "usage: %s [-v] [capture.csv]\n"
+          "       %s -r c|h [-v] [capture.bin]\n", argv[0], argv[0]);
+        return 2;
+    }
+  }
+  const char *path=optind<argc?argv[optind]:NULL;
+  double t=now();
+  if( raw>=0 ) {
+    int fd=NULL==path?0:open(path, O_RDONLY|O_NOCTTY);
+    if( fd<0 ) {
+      perror(path);
+      return 2;
+    }
+    read_raw(fd, raw);
+  } else {
+    FILE *f=NULL==path?stdin:fopen(path, "r");
+    if( NULL==f ) {
+      perror(path);
+      return 2;
+    }
+    read_csv(f);
+  }
+  finish(last_byte, false);
+  t=now()-t;
+  fprintf(stderr, "%lu transactions: %lu SEND, %lu RECEIVE, %lu failed; "
+    "%lu bytes in %.3f s, %.1f MB/s\n", transactions, sends, receives, failures,
+    bytes, t, t>0?bytes/t/1e6:0.0);
+  return 0;
+}
@@ -0,0 +1,89 @@
+/* (C) 2018 by nsg
+ * Checks of mailbox values kept as scaled integers, built with
+ * CASIO_COMPACT and int16_t values in hundredths (see the Makefile).
+ *
+ * usage: casio_value_test
+ *
+ * Exits with 1 if any check fails.
+ */
+#include "Arduino.h"
+#include "CasioSerial.h"
+#include "CasioLoopback.h"
+#include "CasioVirtualCalc.h"
+
+static CasioLoopback link;
+static CasioVirtualCalc calc(&link.calc);
+static unsigned long failed;
+
+static void check(bool ok, const char *what)
+{
+  if( ok ) return;
+  printf("FAILED: %s\n", what);
+  ++failed;
+}
+
+static void run()
+{
+  while( calc.step() ) casio_poll();
+  casio_poll();
+}
+
+static CasioMailBox in[]={ IMMEDIATE('A') };
+static CasioMailBox out[]={ IMMEDIATE('B') };
+
+int main()
+{
+  if( sizeof(CasioValue)!=2 || 100!=CASIO_VALUE_SCALE ) {
+    printf("casio_value_test needs int16_t values in hundredths\n");
+    return 1;
+  }
+
+  // rounded to the nearest hundredth, halves away from zero
+  check(123==casio_to_value(1.23), "1.23");
+  check(113==casio_to_value(1.125), "1.125");
+  check(-113==casio_to_value(-1.125), "-1.125");
+  check(32767==casio_to_value(327.67), "largest");
+  check(-32768==casio_to_value(-327.68), "smallest");
+  check(0==casio_to_value(NAN), "NaN");
+  // out of range values stay at the end of the range they left
+  check(32767==casio_to_value(327.675), "just above");
+  check(32767==casio_to_value(400), "400");
+  check(32767==casio_to_value(1000), "1000");
+  check(32767==casio_to_value(1e10), "1e10");
+  check(32767==casio_to_value(INFINITY), "infinity");
+  check(-32768==casio_to_value(-500), "-500");
+  check(-32768==casio_to_value(-1e10), "-1e10");
+
+  casio_serial=&link.host;
+  fill_static_links(&in[0], 1);
+  fill_static_links(&out[0], 1);
+  casio_inboxes=&in[0];
+  casio_outboxes=&out[0];
+
+  calc.send('A', -12.345);
+  run();
+  check(-1235==in[0].value && in[0].fresh, "SEND(A) of -12.345");
+  calc.send('A', 1000);
+  run();
+  check(32767==in[0].value, "SEND(A) of 1000");
+  calc.send('A', -1e10);
+  run();
+  check(-32768==in[0].value, "SEND(A) of -1e10");
+
+  POST_TO_BOX(out[0], 3.14159);
+  calc.receive('B');
+  run();
+  check(3.14==calc.received, "RECEIVE(B) of 3.14159");
+  POST_TO_BOX(out[0], 1000);
+  calc.receive('B');
+  run();
+  check(327.67==calc.received, "RECEIVE(B) of 1000");
+  POST_TO_BOX(out[0], -500);
+  calc.receive('B');
+  run();
+  check(-327.68==calc.received, "RECEIVE(B) of -500");
+  check(0==calc.errors, "protocol errors");
+
+  printf("%lu checks failed\n", failed);
+  return failed?1:0;
+}
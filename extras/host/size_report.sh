@@ -0,0 +1,64 @@
+#!/bin/sh
+# Flash and RAM cost of each CasioSerial feature switch.
+#
+#   ./size_report.sh                    host build, not AVR figures
+#   CXX=avr-g++ SIZE=avr-size \
+#   FLAGS="-mmcu=atmega328p -DF_CPU=16000000L -DARDUINO=10800" \
+#   INCLUDES="-I<core>/cores/arduino -I<core>/variants/standard" ./size_report.sh
+#
+# The library is compiled with -Os once as configured in CasioSerial.h and
+# once per switch turned the other way with -D; the table shows text (flash), data and
+# bss (RAM) of CasioSerial.o and the change against the default. The last
+# column is the RAM of one CasioMailBox, which the sketch pays per box.
+
+CXX=${CXX:-g++}
+SIZE=${SIZE:-size}
+FLAGS=${FLAGS:-}
+INCLUDES=${INCLUDES:--I$(dirname "$0")}
+LIB=$(cd "$(dirname "$0")/../.." && pwd)
+TMP=$(mktemp -d)
+SMALL="-DCASIO_COMPACT -DCASIO_VALUE_TYPE=int16_t -DCASIO_VALUE_SCALE=100
+  -DCASIO_NO_COMPLEX -DCASIO_NO_LISTS -DCASIO_NO_MATRICES -DCASIO_NO_QUEUES
+  -DCASIO_NO_GROUPS"
+trap 'rm -rf "$TMP"' EXIT
+
+# build flags of the variant
+build() {
+  $CXX -c -Os $FLAGS $1 -I"$LIB" $INCLUDES -o "$TMP/CasioSerial.o" \
+    "$LIB/CasioSerial.cpp" || exit 1
+  echo '#include "Arduino.h"
+#include "CasioSerial.h"
+CasioMailBox probe;' > "$TMP/probe.cpp"
+  $CXX -c -Os $FLAGS $1 -I"$LIB" $INCLUDES -o "$TMP/probe.o" \
+    "$TMP/probe.cpp" || exit 1
+  $SIZE "$TMP/CasioSerial.o" "$TMP/probe.o" |
+    awk 'NR==2 { printf "%s %s %s ", $1, $2, $3 } NR==3 { print $3 }'
+}
+
+row() {
+  set -- "$1" $(build "$2")
+  printf '| %-26s | %6d | %+6d | %5d | %+5d | %5d | %+5d | %3d |\n' "$1" \
+    "$2" $(($2-base_text)) "$3" $(($3-base_data)) "$4" $(($4-base_bss)) "$5"
+}
+
+set -- $(build "")
+base_text=$1 base_data=$2 base_bss=$3
+
+echo "$CXX $FLAGS -Os, CasioSerial.o"
+case "$CXX" in
+  *avr*) ;;
+  *) echo "host build: for comparing switches only, these are not AVR figures" ;;
+esac
+echo
+echo "| configuration              |   text |        |  data |       |   bss |       | box |"
+echo "|----------------------------|-------:|-------:|------:|------:|------:|------:|----:|"
+row default ""
+for f in STATIC_MAILBOX LOOKUP_TABLE BLOCK_IO COMPLEX LISTS MATRICES QUEUES GROUPS; do
+  row "no CASIO_$f" "-DCASIO_NO_$f"
+done
+row "CASIO_STATS" "-DCASIO_STATS"
+row "CASIO_LOG_LEVEL 3" "-DCASIO_LOG_LEVEL=3"
+row "CASIO_LOG_BUFFER 8" "-DCASIO_LOG_LEVEL=3 -DCASIO_LOG_BUFFER=8"
+row "CASIO_COMPACT" "-DCASIO_COMPACT"
+row "CASIO_COMPACT, float" "-DCASIO_COMPACT -DCASIO_VALUE_TYPE=float"
+row "small" "$SMALL"